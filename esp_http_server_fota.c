@@ -4,13 +4,24 @@
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <esp_http_server.h>
 #include <esp_system.h>
 #include <esp_ota_ops.h>
 #include <esp_image_format.h>
+#ifndef CONFIG_IDF_TARGET_ESP8266
+#include <esp_flash_encrypt.h>
+#endif
 #include <esp_log.h>
+#ifdef CONFIG_HTTPD_FOTA_RESUME
+#include <nvs.h>
+#endif
 #include <sys/param.h>
 #include <inttypes.h>
+#include <strings.h>
 
 #include "include/esp_http_server_fota.h"
 #include "include/esp_http_server_misc.h"
@@ -20,21 +31,95 @@
 #define esp_ota_get_app_description esp_app_get_description
 #endif
 
+#if CONFIG_IDF_TARGET_ESP8266
+#define esp_ota_abort esp_ota_end //release OTA handle, image is not valid anyway
+#endif
+
 static const char *TAG = "FOTA";
-static const int OTA_RECV_TIMEOUT_RETRIES = 3;
+
+#define APP_INFO_LEN 384 //largest rendered app description
+
+//running image does not change, it is hashed and rendered once per encoding
+static char app_info_sha256[2 * UPLOAD_DIGEST_LEN + 1];
+static char *app_info_body[2]; //JSON, CBOR
+static size_t app_info_len[2];
+
+static void app_info_to_json(esp_httpd_json_t *jw, const esp_app_desc_t *app_descr)
+{
+    esp_httpd_json_string(jw, "version", app_descr->version);
+    esp_httpd_json_string(jw, "project_name", app_descr->project_name);
+    esp_httpd_json_string(jw, "time", app_descr->time);
+    esp_httpd_json_string(jw, "date", app_descr->date);
+    esp_httpd_json_string(jw, "idf_ver", app_descr->idf_ver);
+    if (app_info_sha256[0])
+        esp_httpd_json_string(jw, "sha256", app_info_sha256);
+}
+
+static void app_info_hash(void)
+{
+    uint8_t digest[UPLOAD_DIGEST_LEN];
+
+    if (app_info_sha256[0])
+        return;
+    if (esp_partition_get_sha256(esp_ota_get_running_partition(), digest) == ESP_OK) {
+        for (int i = 0; i < UPLOAD_DIGEST_LEN; i++)
+            sprintf(app_info_sha256 + 2 * i, "%02x", digest[i]);
+    }
+}
+
+void esp_httpd_app_info_section(esp_httpd_json_t *jw, const esp_httpd_batch_t *sel, void *arg)
+{
+    app_info_hash();
+    app_info_to_json(jw, esp_ota_get_app_description());
+}
 
 esp_err_t esp_httpd_app_info_handler(httpd_req_t *req)
 {
     const esp_app_desc_t *app_descr = esp_ota_get_app_description();
+    esp_httpd_json_t jw;
+    char etag[HTTPD_ETAG_LEN];
 
-    cJSON *js = cJSON_CreateObject();
-    cJSON_AddStringToObject(js, "version", app_descr->version);
-    cJSON_AddStringToObject(js, "project_name", app_descr->project_name);
-    cJSON_AddStringToObject(js, "time", app_descr->time);
-    cJSON_AddStringToObject(js, "date", app_descr->date);
-    cJSON_AddStringToObject(js, "idf_ver", app_descr->idf_ver);
+    app_info_hash();
 
-    return esp_httpd_resp_json(req, js);
+    //firmware digest is the ETag, same as If-None-Match of upload handlers
+    if (esp_httpd_resp_not_modified(req, etag, app_info_sha256[0] ? app_info_sha256 : app_descr->version))
+        return ESP_OK;
+
+    int cbor = esp_httpd_json_accepts_cbor(req);
+    if (!app_info_body[cbor]) {
+        char *body = malloc(APP_INFO_LEN);
+        if (body) {
+            esp_httpd_json_begin_buf(&jw, req, body, APP_INFO_LEN);
+            app_info_to_json(&jw, app_descr);
+            if (esp_httpd_json_end(&jw) == ESP_OK) {
+                char *fit = realloc(body, jw.out_len);
+                app_info_body[cbor] = fit ? fit : body;
+                app_info_len[cbor] = jw.out_len;
+            } else {
+                free(body);
+            }
+        }
+    }
+
+    if (!app_info_body[cbor]) {
+        esp_httpd_json_begin(&jw, req);
+        app_info_to_json(&jw, app_descr);
+        return esp_httpd_json_end(&jw);
+    }
+    httpd_resp_set_type(req, cbor ? HTTPD_TYPE_CBOR : HTTPD_TYPE_JSON);
+    httpd_resp_set_hdr(req, "Vary", "Accept");
+    return httpd_resp_send(req, app_info_body[cbor], app_info_len[cbor]);
+}
+
+//If-None-Match names running image or image waiting for reboot
+static bool fota_installed(httpd_req_t *req, uint8_t digest[UPLOAD_DIGEST_LEN])
+{
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    const esp_partition_t *boot = esp_ota_get_boot_partition();
+
+    if (esp_http_upload_match_partition(req, running, digest) == ESP_OK)
+        return true;
+    return boot && boot != running && esp_http_upload_match_partition(req, boot, digest) == ESP_OK;
 }
 
 static void handle_ota_failed_action(esp_ota_actions_t *ota_actions)
@@ -43,242 +128,1209 @@ static void handle_ota_failed_action(esp_ota_actions_t *ota_actions)
         ota_actions->on_update_failed(ota_actions->arg);
 }
 
-#ifdef CONFIG_APP_UPDATE_CHECK_PROJECT_NAME
-static esp_err_t esp_httpd_fota_get_partition_descr(const esp_partition_t *part, esp_app_desc_t *descr)
+#if defined(CONFIG_HTTPD_UPLOAD_INCREMENTAL_ERASE) && !CONFIG_IDF_TARGET_ESP8266
+/* Only first sector is erased by esp_ota_begin, other sectors are erased right
+before they are written and data is placed with esp_ota_write_with_offset */
+#define FOTA_INCREMENTAL_ERASE 1
+#define FOTA_WRITE_ALIGN 16 //esp_ota_write_with_offset length alignment with flash encryption
+#endif
+
+/* Open update handle, resumed upload continues at offset. */
+static esp_err_t fota_ota_begin(const esp_partition_t *part, size_t offset, esp_ota_handle_t *handle)
+{
+#ifdef FOTA_INCREMENTAL_ERASE
+    /* OTA_WITH_SEQUENTIAL_WRITES leaves erase pending in handle and
+    esp_ota_write_with_offset asserts on it. One sector image size erases
+    only first sector, the rest is erased by fota_flash_write. */
+    size_t first_len = MIN(offset, SPI_FLASH_SEC_SIZE);
+    size_t sector = offset - offset % SPI_FLASH_SEC_SIZE;
+    size_t sector_len = sector > 0 ? offset - sector : 0;
+    char *first = NULL, *last = NULL;
+    esp_err_t err = ESP_OK;
+
+    /* Resumed upload keeps image bytes written before offset. Tail of sector
+    holding offset may hold data or padding written past committed offset, so
+    it is erased too. Offset is aligned for encrypted writes. */
+    if (first_len > 0) {
+        first = malloc(first_len);
+        err = first ? esp_partition_read(part, 0, first, first_len) : ESP_ERR_NO_MEM;
+    }
+    if (err == ESP_OK && sector_len > 0) {
+        last = malloc(sector_len);
+        err = last ? esp_partition_read(part, sector, last, sector_len) : ESP_ERR_NO_MEM;
+    }
+
+    if (err == ESP_OK)
+        err = esp_ota_begin(part, SPI_FLASH_SEC_SIZE, handle);
+    if (err == ESP_OK) {
+        if (first_len > 0)
+            err = esp_ota_write_with_offset(*handle, first, first_len, 0);
+        if (err == ESP_OK && sector_len > 0)
+            err = esp_partition_erase_range(part, sector, SPI_FLASH_SEC_SIZE);
+        if (err == ESP_OK && sector_len > 0)
+            err = esp_ota_write_with_offset(*handle, last, sector_len, sector);
+        if (err != ESP_OK)
+            esp_ota_abort(*handle);
+    }
+    free(first);
+    free(last);
+    return err;
+#else
+    return esp_ota_begin(part, OTA_SIZE_UNKNOWN, handle);
+#endif
+}
+
+typedef struct {
+    esp_ota_handle_t handle;
+#ifdef FOTA_INCREMENTAL_ERASE
+    esp_http_upload_erase_t erase;
+    size_t offset;
+#endif
+} fota_flash_t;
+
+static void fota_flash_init(fota_flash_t *fl, esp_ota_handle_t handle, const esp_partition_t *part, size_t offset)
 {
-    esp_image_header_t esp_image_header;
-    esp_image_segment_header_t seg1_hdr;
+    fl->handle = handle;
+#ifdef FOTA_INCREMENTAL_ERASE
+    esp_http_upload_erase_init(&fl->erase, part);
+    //fota_ota_begin left sectors up to offset erased past written image bytes
+    fl->erase.erased = (offset + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    fl->offset = offset;
+#endif
+}
+
+static esp_err_t fota_flash_write(fota_flash_t *fl, const char *data, size_t len)
+{
+    esp_err_t err;
+
+#ifdef FOTA_INCREMENTAL_ERASE
+    //only last block of image may be unaligned, encrypted write is padded with 0xff
+    size_t tail = esp_flash_encryption_enabled() ? len % FOTA_WRITE_ALIGN : 0;
+    size_t pad = tail ? FOTA_WRITE_ALIGN - tail : 0;
+
+    err = esp_http_upload_erase_range(&fl->erase, fl->offset, len + pad);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "erase error: err=0x%x", err);
+        return err;
+    }
+    err = esp_ota_write_with_offset(fl->handle, (const void *)data, len - tail, fl->offset);
+    if (err == ESP_OK && tail) {
+        char last[FOTA_WRITE_ALIGN];
+        memset(last, 0xff, sizeof(last));
+        memcpy(last, data + len - tail, tail);
+        err = esp_ota_write_with_offset(fl->handle, last, sizeof(last), fl->offset + len - tail);
+    }
+    if (err == ESP_OK)
+        fl->offset += len;
+#else
+    err = esp_ota_write(fl->handle, (const void *)data, len);
+#endif
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "esp_ota_write error: err=0x%x", err);
+    return err;
+}
+
+#ifdef CONFIG_HTTPD_FOTA_PIPELINE
+//ring buffers and writer task stack
+#define FOTA_WRITER_HEAP (CONFIG_HTTPD_FOTA_PIPELINE_DEPTH * UPLOAD_BUF_LEN + CONFIG_HTTPD_FOTA_WRITER_TASK_STACK_SIZE)
+
+typedef struct {
+    char *data;
+    size_t len;
+} fota_block_t;
+
+/* Firmware writer: received data is collected into ring of blocks, full
+blocks are passed to writer task calling esp_ota_write. Free blocks queue
+provides backpressure for receiving side. */
+typedef struct {
+    fota_flash_t flash;
+    QueueHandle_t free_q;
+    QueueHandle_t full_q;
+    SemaphoreHandle_t done;
+    fota_block_t blocks[CONFIG_HTTPD_FOTA_PIPELINE_DEPTH];
+    fota_block_t *cur;
+    volatile esp_err_t err;
+} fota_writer_t;
+
+static void fota_writer_task(void *arg)
+{
+    fota_writer_t *wr = arg;
+    fota_block_t *blk;
+
+    while (xQueueReceive(wr->full_q, &blk, portMAX_DELAY) == pdTRUE) {
+        if (!blk)
+            break; //end of data
+
+        if (wr->err == ESP_OK)
+            wr->err = fota_flash_write(&wr->flash, blk->data, blk->len);
+        xQueueSend(wr->free_q, &blk, portMAX_DELAY);
+    }
+    xSemaphoreGive(wr->done);
+    vTaskDelete(NULL);
+}
+
+static void fota_writer_free(fota_writer_t *wr)
+{
+    for (int i = 0; i < CONFIG_HTTPD_FOTA_PIPELINE_DEPTH; i++)
+        free(wr->blocks[i].data);
+    if (wr->free_q)
+        vQueueDelete(wr->free_q);
+    if (wr->full_q)
+        vQueueDelete(wr->full_q);
+    if (wr->done)
+        vSemaphoreDelete(wr->done);
+}
+
+static esp_err_t fota_writer_begin(fota_writer_t *wr, esp_ota_handle_t handle, const esp_partition_t *part,
+                                   size_t offset)
+{
+    BaseType_t rc;
+
+    memset(wr, 0, sizeof(fota_writer_t));
+    fota_flash_init(&wr->flash, handle, part, offset);
+    wr->free_q = xQueueCreate(CONFIG_HTTPD_FOTA_PIPELINE_DEPTH, sizeof(fota_block_t *));
+    wr->full_q = xQueueCreate(CONFIG_HTTPD_FOTA_PIPELINE_DEPTH + 1, sizeof(fota_block_t *)); //one more for end marker
+    wr->done = xSemaphoreCreateBinary();
+    if (!wr->free_q || !wr->full_q || !wr->done) {
+        fota_writer_free(wr);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < CONFIG_HTTPD_FOTA_PIPELINE_DEPTH; i++) {
+        fota_block_t *blk = &wr->blocks[i];
+        blk->data = malloc(UPLOAD_BUF_LEN);
+        if (!blk->data) {
+            fota_writer_free(wr);
+            return ESP_ERR_NO_MEM;
+        }
+        xQueueSend(wr->free_q, &blk, 0);
+    }
+
+#if defined(CONFIG_HTTPD_FOTA_WRITER_TASK_CORE) && CONFIG_HTTPD_FOTA_WRITER_TASK_CORE >= 0
+    rc = xTaskCreatePinnedToCore(fota_writer_task, "fota_writer", CONFIG_HTTPD_FOTA_WRITER_TASK_STACK_SIZE, wr,
+                                 CONFIG_HTTPD_FOTA_WRITER_TASK_PRIORITY, NULL, CONFIG_HTTPD_FOTA_WRITER_TASK_CORE);
+#else
+    rc = xTaskCreate(fota_writer_task, "fota_writer", CONFIG_HTTPD_FOTA_WRITER_TASK_STACK_SIZE, wr,
+                     CONFIG_HTTPD_FOTA_WRITER_TASK_PRIORITY, NULL);
+#endif
+    if (rc != pdPASS) {
+        fota_writer_free(wr);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t fota_writer_write(fota_writer_t *wr, const char *data, size_t len)
+{
+    while (len > 0) {
+        if (!wr->cur) {
+            xQueueReceive(wr->free_q, &wr->cur, portMAX_DELAY);
+            wr->cur->len = 0;
+        }
+        if (wr->err != ESP_OK)
+            return wr->err;
+
+        size_t n = MIN(len, UPLOAD_BUF_LEN - wr->cur->len);
+        memcpy(wr->cur->data + wr->cur->len, data, n);
+        wr->cur->len += n;
+        data += n;
+        len -= n;
+
+        if (wr->cur->len == UPLOAD_BUF_LEN) {
+            xQueueSend(wr->full_q, &wr->cur, portMAX_DELAY);
+            wr->cur = NULL;
+        }
+    }
+    return ESP_OK;
+}
+
+//flush pending data, wait for writer task and release resources
+static esp_err_t fota_writer_end(fota_writer_t *wr)
+{
+    fota_block_t *end = NULL;
+
+    if (wr->cur && wr->cur->len > 0)
+        xQueueSend(wr->full_q, &wr->cur, portMAX_DELAY);
+    xQueueSend(wr->full_q, &end, portMAX_DELAY);
+    xSemaphoreTake(wr->done, portMAX_DELAY);
+
+    esp_err_t err = wr->err;
+    fota_writer_free(wr);
+    return err;
+}
+#else
+#define FOTA_WRITER_HEAP UPLOAD_BUF_LEN
+
+typedef struct {
+    fota_flash_t flash;
+    esp_http_upload_coalesce_t blocks;
+} fota_writer_t;
+
+static esp_err_t fota_writer_flush(void *ctx, const char *data, size_t len)
+{
+    fota_writer_t *wr = ctx;
+    return fota_flash_write(&wr->flash, data, len);
+}
+
+static esp_err_t fota_writer_begin(fota_writer_t *wr, esp_ota_handle_t handle, const esp_partition_t *part,
+                                   size_t offset)
+{
+    fota_flash_init(&wr->flash, handle, part, offset);
+    return esp_http_upload_coalesce_init(&wr->blocks, UPLOAD_BUF_LEN, fota_writer_flush, wr);
+}
+
+static esp_err_t fota_writer_write(fota_writer_t *wr, const char *data, size_t len)
+{
+    return esp_http_upload_coalesce_write(&wr->blocks, data, len);
+}
+
+//write pending data and release resources
+static esp_err_t fota_writer_end(fota_writer_t *wr)
+{
+    esp_err_t err = esp_http_upload_coalesce_flush(&wr->blocks);
+    esp_http_upload_coalesce_free(&wr->blocks);
+    return err;
+}
+#endif
+
+/* Image headers are validated while firmware is streamed, so wrong image is
+rejected within first bytes instead of after full erase, transfer and write */
+typedef struct {
+    size_t offset; //stream bytes already checked
+    esp_image_header_t image_header;
+    esp_image_segment_header_t seg_header;
     esp_app_desc_t app_desc;
-    esp_err_t esp_err;
+    size_t desc_offset;
+    bool done;
+} fota_image_check_t;
 
-    /* Try to get description standard way */
-    esp_err = esp_ota_get_partition_description(part, &app_desc);
-    if (esp_err == ESP_OK) {
-        *descr = app_desc;
+//copy part of data stream which overlaps with [dst_offset, dst_offset + dst_len) field
+static void fota_image_capture(void *dst, size_t dst_offset, size_t dst_len, const char *data, size_t len,
+                               size_t offset)
+{
+    size_t start = MAX(dst_offset, offset);
+    size_t end = MIN(dst_offset + dst_len, offset + len);
+
+    if (start < end)
+        memcpy((char *)dst + (start - dst_offset), data + (start - offset), end - start);
+}
+
+static esp_err_t fota_image_check_header(fota_image_check_t *chk)
+{
+    if (chk->image_header.magic != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(TAG, "image header magic != 0x%02x", ESP_IMAGE_HEADER_MAGIC);
+        return ESP_ERR_IMAGE_INVALID;
+    }
+#ifndef CONFIG_IDF_TARGET_ESP8266
+    if (chk->image_header.chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID) {
+        ESP_LOGE(TAG, "image chip id %d != %d", chk->image_header.chip_id, CONFIG_IDF_FIRMWARE_CHIP_ID);
+        return ESP_ERR_IMAGE_INVALID;
+    }
+#endif
+    return ESP_OK;
+}
+
+static esp_err_t fota_image_check_descr(fota_image_check_t *chk)
+{
+    const esp_app_desc_t *descr = &chk->app_desc;
+
+    if (descr->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        ESP_LOGE(TAG, "app description not found");
+        return ESP_ERR_IMAGE_INVALID;
+    }
+    ESP_LOGI(TAG, "new firmware: %.32s ver %.32s %.16s %.16s", descr->project_name, descr->version, descr->date,
+             descr->time);
+
+#if defined(CONFIG_APP_UPDATE_CHECK_PROJECT_NAME) || defined(CONFIG_APP_UPDATE_REJECT_SAME_VERSION)
+    const esp_app_desc_t *app_descr = esp_ota_get_app_description();
+#endif
+#ifdef CONFIG_APP_UPDATE_CHECK_PROJECT_NAME
+    if (strncmp(app_descr->project_name, descr->project_name, sizeof(descr->project_name)) != 0) {
+        ESP_LOGE(TAG, "update PROJECT_NAME != %s", app_descr->project_name);
+        return ESP_ERR_IMAGE_INVALID;
+    }
+    ESP_LOGI(TAG, "PROJECT_NAME: check OK");
+#endif
+#ifdef CONFIG_APP_UPDATE_REJECT_SAME_VERSION
+    if (strncmp(app_descr->version, descr->version, sizeof(descr->version)) == 0) {
+        ESP_LOGE(TAG, "update version %s is already running", app_descr->version);
+        return ESP_ERR_INVALID_VERSION;
+    }
+#endif
+    return ESP_OK;
+}
+
+static void fota_image_check_init(fota_image_check_t *chk)
+{
+    memset(chk, 0, sizeof(fota_image_check_t));
+    //app description is placed at the beginning of first segment
+    chk->desc_offset = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+}
+
+static esp_err_t fota_image_check(fota_image_check_t *chk, const char *data, size_t len)
+{
+    const size_t headers_len = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+    size_t offset = chk->offset;
+    esp_err_t err;
+
+    if (chk->done)
         return ESP_OK;
+
+    chk->offset += len;
+    fota_image_capture(&chk->image_header, 0, sizeof(esp_image_header_t), data, len, offset);
+    fota_image_capture(&chk->seg_header, sizeof(esp_image_header_t), sizeof(esp_image_segment_header_t), data, len,
+                       offset);
+    fota_image_capture(&chk->app_desc, chk->desc_offset, sizeof(esp_app_desc_t), data, len, offset);
+
+    if (offset < headers_len && chk->offset >= headers_len) {
+        err = fota_image_check_header(chk);
+        if (err != ESP_OK)
+            return err;
     }
 
-    /* Now try to read image headers */
-    esp_err = esp_partition_read(part, 0, &esp_image_header, sizeof(esp_image_header_t));
-    if (esp_err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_partition_read err=0x%x %s", esp_err, esp_err_to_name(esp_err));
-        return esp_err;
+#if CONFIG_IDF_TARGET_ESP8266
+    /* Magic word decides segment as soon as it is received. Second segment
+    starts past it, so its description is captured from this data on and
+    nothing received earlier is needed */
+    const size_t magic_end = headers_len + sizeof(chk->app_desc.magic_word);
+    if (offset < magic_end && chk->offset >= magic_end && chk->app_desc.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        //try second flash segment
+        chk->desc_offset = headers_len + chk->seg_header.data_len + sizeof(esp_image_segment_header_t);
+        memset(&chk->app_desc, 0, sizeof(esp_app_desc_t));
+        fota_image_capture(&chk->app_desc, chk->desc_offset, sizeof(esp_app_desc_t), data, len, offset);
     }
+#endif
+
+    if (chk->offset < chk->desc_offset + sizeof(esp_app_desc_t))
+        return ESP_OK;
+
+    chk->done = true;
+    return fota_image_check_descr(chk);
+}
+
+//firmware sink, image check followed by flash writer
+typedef struct {
+    fota_image_check_t check;
+    fota_writer_t writer;
+} fota_image_t;
+
+static esp_err_t fota_image_write(void *ctx, const char *data, size_t len)
+{
+    fota_image_t *img = ctx;
+    esp_err_t err;
+
+    err = fota_image_check(&img->check, data, len);
+    if (err != ESP_OK)
+        return err;
+    return fota_writer_write(&img->writer, data, len);
+}
+
+//pipeline sink, writer is ended by handler which needs its result
+static const esp_http_upload_stage_ops_t fota_image_ops = {
+    .write = fota_image_write,
+};
+
+#ifdef CONFIG_HTTPD_FOTA_DECOMPRESS
+static bool fota_part_is_gzip(const esp_http_multipart_part_t *part)
+{
+    return !strcasecmp(part->encoding, "gzip") || !strcasecmp(part->content_type, "application/gzip") ||
+           !strcasecmp(part->content_type, "application/x-gzip");
+}
 
-    if (esp_image_header.magic != ESP_IMAGE_HEADER_MAGIC) {
-        ESP_LOGE(TAG, "image header magic !=0x02%x", ESP_IMAGE_HEADER_MAGIC);
+#endif
+
+#if defined(CONFIG_HTTPD_FOTA_RESUME) || defined(CONFIG_HTTPD_FOTA_RANGED)
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+    uint32_t size;    //image size
+    uint8_t hash[32]; //image SHA-256 given by client
+} fota_range_t;
+
+//Content-Range: bytes <first>-<last>/<size> and X-Image-Hash: <hex SHA-256>
+static esp_err_t fota_range_parse(httpd_req_t *req, fota_range_t *range)
+{
+    char buf[72];
+    unsigned int first, last, size;
+
+    if (httpd_req_get_hdr_value_str(req, "Content-Range", buf, sizeof(buf)) != ESP_OK)
         return ESP_ERR_NOT_FOUND;
+    if (sscanf(buf, "bytes %u-%u/%u", &first, &last, &size) != 3 || first > last || last >= size) {
+        ESP_LOGE(TAG, "bad Content-Range: %s", buf);
+        return ESP_ERR_INVALID_ARG;
     }
 
-    esp_err = esp_partition_read(part, sizeof(esp_image_header_t), &seg1_hdr, sizeof(esp_image_segment_header_t));
-    if (esp_err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_partition_read err=0x%x %s", esp_err, esp_err_to_name(esp_err));
-        return esp_err;
+    if (httpd_req_get_hdr_value_str(req, UPLOAD_DIGEST_HEADER, buf, sizeof(buf)) != ESP_OK ||
+        esp_http_upload_parse_digest(buf, range->hash) != ESP_OK) {
+        ESP_LOGE(TAG, "%s missing", UPLOAD_DIGEST_HEADER);
+        return ESP_ERR_INVALID_ARG;
     }
+    range->first = first;
+    range->last = last;
+    range->size = size;
+    return ESP_OK;
+}
+#endif
+
+#ifdef CONFIG_HTTPD_FOTA_RESUME
+#define FOTA_RESUME_NAMESPACE "httpd_fota"
+#define FOTA_RESUME_KEY "resume"
+#define FOTA_RESUME_ALIGN 16 //esp_ota_write_with_offset alignment with flash encryption
+
+/* Resumable upload: client sends image ranges with Content-Range and
+X-Image-Hash headers, offset committed to flash is kept in NVS so upload
+continues after dropped connection or reboot */
+typedef struct {
+    uint32_t part;    //update partition address
+    uint32_t size;    //image size
+    uint8_t hash[32]; //image SHA-256 given by client
+    uint32_t offset;  //image bytes committed to flash
+} fota_resume_t;
 
-    /* App description should be located in the second flash segment */
-    size_t desc_offset = sizeof(esp_image_header_t);
-    desc_offset += sizeof(esp_image_segment_header_t) + seg1_hdr.data_len;
-    desc_offset += sizeof(esp_image_segment_header_t);
+static esp_err_t fota_resume_load(fota_resume_t *rs)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(fota_resume_t);
+    esp_err_t err;
+
+    err = nvs_open(FOTA_RESUME_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK)
+        return err;
+    err = nvs_get_blob(nvs, FOTA_RESUME_KEY, rs, &len);
+    nvs_close(nvs);
+    if (err == ESP_OK && len != sizeof(fota_resume_t))
+        err = ESP_ERR_INVALID_SIZE;
+    return err;
+}
 
-    esp_err = esp_partition_read(part, desc_offset, &app_desc, sizeof(esp_app_desc_t));
-    if (esp_err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_partition_read err=0x%x %s", esp_err, esp_err_to_name(esp_err));
-        return esp_err;
+//store upload state, NULL clears it
+static esp_err_t fota_resume_save(const fota_resume_t *rs)
+{
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    err = nvs_open(FOTA_RESUME_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_open failed: err=0x%x", err);
+        return err;
+    }
+    if (rs) {
+        err = nvs_set_blob(nvs, FOTA_RESUME_KEY, rs, sizeof(fota_resume_t));
+    } else {
+        err = nvs_erase_key(nvs, FOTA_RESUME_KEY);
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+            err = ESP_OK;
     }
+    if (err == ESP_OK)
+        err = nvs_commit(nvs);
+    nvs_close(nvs);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "resume state save failed: err=0x%x", err);
+    return err;
+}
 
-    if (app_desc.magic_word == ESP_APP_DESC_MAGIC_WORD) {
-        *descr = app_desc;
-        return ESP_OK;
+/* Match ranged request with stored upload, range at offset 0 starts new one.
+Plain upload overwrites partition, so stored upload is dropped. */
+static esp_err_t fota_resume_begin(httpd_req_t *req, const esp_partition_t *part, fota_resume_t *rs)
+{
+    fota_resume_t stored;
+    fota_range_t range;
+    esp_err_t err;
+
+    err = fota_range_parse(req, &range);
+    if (err == ESP_ERR_NOT_FOUND)
+        fota_resume_save(NULL);
+    if (err != ESP_OK)
+        return err;
+
+    rs->part = part->address;
+    rs->size = range.size;
+    rs->offset = range.first;
+    memcpy(rs->hash, range.hash, sizeof(rs->hash));
+    if (rs->offset == 0)
+        return fota_resume_save(rs);
+
+    if (fota_resume_load(&stored) != ESP_OK || stored.part != rs->part || stored.size != rs->size ||
+        memcmp(stored.hash, rs->hash, sizeof(rs->hash)) != 0) {
+        ESP_LOGE(TAG, "no upload to resume");
+        rs->offset = 0;
+        return ESP_ERR_INVALID_STATE;
     }
-    return ESP_ERR_NOT_FOUND;
+    if (stored.offset != rs->offset) {
+        ESP_LOGE(TAG, "resume offset %" PRIu32 " != %" PRIu32, rs->offset, stored.offset);
+        rs->offset = stored.offset;
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
 }
-#endif
 
-esp_err_t esp_httpd_fota_handler(httpd_req_t *req)
+//commit image bytes written so far
+static void fota_resume_commit(fota_resume_t *rs, size_t offset)
 {
-    esp_ota_handle_t update_handle;
-    const esp_partition_t *update_partition;
-    esp_ota_actions_t *ota_actions = req->user_ctx;
-    esp_err_t ota_err;
+    rs->offset = offset & ~(FOTA_RESUME_ALIGN - 1);
+    fota_resume_save(rs);
+    ESP_LOGI(TAG, "upload can be resumed at %" PRIu32 "/%" PRIu32, rs->offset, rs->size);
+}
 
-    ESP_LOGI(TAG, "starting FOTA...");
-    // do before update action
-    if (ota_actions && ota_actions->on_update_init)
-        ota_actions->on_update_init(ota_actions->arg);
+static esp_err_t fota_resume_resp(httpd_req_t *req, esp_err_t rc, const fota_resume_t *rs)
+{
+    esp_httpd_json_t jw;
+
+    if (rc != ESP_OK) {
+        //request body is not received
+        if (rc == ESP_ERR_INVALID_STATE)
+            httpd_resp_set_status(req, "416 Range Not Satisfiable");
+        httpd_resp_set_hdr(req, "Connection", "close");
+    }
+
+    esp_httpd_json_begin(&jw, req);
+    esp_httpd_json_string(&jw, "result", esp_err_to_name(rc));
+    esp_httpd_json_int(&jw, "size", rs->size);
+    esp_httpd_json_int(&jw, "offset", rs->offset);
+    esp_err_t err = esp_httpd_json_end(&jw);
+    return rc == ESP_OK ? err : ESP_FAIL;
+}
+
+esp_err_t esp_httpd_fota_status_handler(httpd_req_t *req)
+{
+    const esp_partition_t *part = esp_ota_get_next_update_partition(NULL);
+    fota_resume_t rs;
+    esp_err_t err;
+    char hash[2 * sizeof(rs.hash) + 1];
+
+    err = fota_resume_load(&rs);
+    if (err == ESP_OK && (!part || rs.part != part->address))
+        err = ESP_ERR_NOT_FOUND;
+    if (err != ESP_OK)
+        memset(&rs, 0, sizeof(rs));
+
+    esp_httpd_json_t jw;
+    esp_httpd_json_begin(&jw, req);
+    esp_httpd_json_string(&jw, "result", esp_err_to_name(err));
+    esp_httpd_json_int(&jw, "size", rs.size);
+    esp_httpd_json_int(&jw, "offset", rs.offset);
+    if (err == ESP_OK) {
+        for (int i = 0; i < sizeof(rs.hash); i++)
+            sprintf(hash + 2 * i, "%02x", rs.hash[i]);
+        esp_httpd_json_string(&jw, "hash", hash);
+    }
+    return esp_httpd_json_end(&jw);
+}
+#endif
 
-    char boundary[BOUNDARY_LEN] = { 0 };
-    size_t bytes_left = req->content_len;
-    int32_t bytes_read = 0;
+//whole image written, validate it and boot from it
+static esp_err_t fota_activate(httpd_req_t *req, esp_ota_handle_t update_handle, const esp_partition_t *update_partition,
+                               esp_ota_actions_t *ota_actions, const esp_http_upload_stats_t *stats)
+{
+    esp_err_t ota_err;
 
-    ota_err = esp_http_get_boundary(req, boundary);
+    ota_err = esp_ota_end(update_handle);
     if (ota_err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_end failed! err=0x%x. Image is invalid", ota_err);
         handle_ota_failed_action(ota_actions);
-        return esp_http_upload_json_status(req, ota_err, 0);
+        return esp_http_upload_json_stats(req, ota_err, stats);
     }
 
-    //Read request initial data
-    bytes_read = esp_http_upload_check_initial_boundary(req, boundary, bytes_left);
-    if (bytes_read > 0) {
-        bytes_left -= bytes_read;
-    } else {
+    ota_err = esp_ota_set_boot_partition(update_partition);
+    if (ota_err != ESP_OK) {
         handle_ota_failed_action(ota_actions);
-        return esp_http_upload_json_status(req, ESP_ERR_INVALID_ARG, 0);
+        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed! err=0x%x", ota_err);
+        return esp_http_upload_json_stats(req, ota_err, stats);
     }
 
-    bytes_read = esp_http_upload_find_multipart_header_end(req, bytes_left);
-    if (bytes_read > 0) {
-        bytes_left -= bytes_read;
+    //do after update complete action
+    if (ota_actions && ota_actions->on_update_complete)
+        ota_actions->on_update_complete(ota_actions->arg);
+
+    esp_http_upload_json_stats(req, ESP_OK, stats);
+
+    if (ota_actions && ota_actions->skip_reboot) {
+        ESP_LOGI(TAG, "reboot skipped");
     } else {
-        handle_ota_failed_action(ota_actions);
-        return esp_http_upload_json_status(req, ESP_ERR_INVALID_ARG, 0);
+        ESP_LOGI(TAG, "esp reboot..");
+        vTaskDelay(1000 / portTICK_PERIOD_MS); //let esp send response before reboot
+        esp_restart();
     }
+    return ESP_OK;
+}
 
-    //now we have content data until end boundary with additional '--' at the end
-    size_t boundary_len = strlen(boundary);
-    size_t final_boundary_len = boundary_len + 2;               // additional "--"
-    size_t binary_size = bytes_left - (final_boundary_len + 4); // CRLF CRLF
-    size_t bytes_written = 0;
-    size_t to_read;
-    int recv;
-    int timeout_retries = 0;
+//full image or delta upload, data flows through optional inflate and patch stages into image sink
+static esp_err_t fota_upload(httpd_req_t *req, bool delta)
+{
+    esp_ota_handle_t update_handle;
+    const esp_partition_t *update_partition;
+    esp_ota_actions_t *ota_actions = req->user_ctx;
+    uint8_t installed[UPLOAD_DIGEST_LEN];
+    esp_err_t ota_err;
 
-    if (binary_size == 0) {
-        ESP_LOGE(TAG, "no file uploaded");
+    if (fota_installed(req, installed))
+        return esp_http_upload_not_modified(req, installed);
+
+    ESP_LOGI(TAG, "starting FOTA...");
+    // do before update action
+    if (ota_actions && ota_actions->on_update_init)
+        ota_actions->on_update_init(ota_actions->arg);
+
+    esp_http_upload_pipeline_t pl;
+    fota_image_t image;
+    esp_http_upload_stats_t stats = { 0 };
+#ifdef CONFIG_HTTPD_FOTA_DECOMPRESS
+    esp_http_upload_inflate_t inflate;
+    bool compressed;
+#endif
+#ifdef CONFIG_HTTPD_FOTA_DELTA
+    esp_http_upload_patch_t patch;
+#endif
+#ifdef CONFIG_HTTPD_FOTA_RESUME
+    fota_resume_t resume = { 0 };
+    bool ranged = false;
+#endif
+    size_t offset = 0;
+
+    ota_err = esp_http_upload_pipeline_begin(&pl, req, &stats);
+    if (ota_err != ESP_OK) {
         handle_ota_failed_action(ota_actions);
-        return esp_http_upload_json_status(req, ESP_ERR_NOT_FOUND, 0);
+        return esp_http_upload_json_status(req, ota_err, 0);
     }
 
     // prepare partition
     update_partition = esp_ota_get_next_update_partition(NULL);
     if (!update_partition) {
         ESP_LOGE(TAG, "update part not found");
+        esp_http_upload_pipeline_end(&pl);
         handle_ota_failed_action(ota_actions);
         return esp_http_upload_json_status(req, ESP_FAIL, 0);
     }
     ESP_LOGI(TAG, "write partition %s typ %d sub %d at offset 0x%" PRIx32, update_partition->label, update_partition->type,
              update_partition->subtype, update_partition->address);
 
-    ota_err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &update_handle);
+#ifdef CONFIG_HTTPD_FOTA_RESUME
+    ota_err = fota_resume_begin(req, update_partition, &resume);
+    //patch and gzip streams cannot be resumed at image offset
+    if (ota_err == ESP_OK && delta)
+        ota_err = ESP_ERR_NOT_SUPPORTED;
+#ifdef CONFIG_HTTPD_FOTA_DECOMPRESS
+    if (ota_err == ESP_OK && fota_part_is_gzip(&pl.mp.part))
+        ota_err = ESP_ERR_NOT_SUPPORTED;
+#endif
+    if (ota_err != ESP_OK && ota_err != ESP_ERR_NOT_FOUND) {
+        esp_http_upload_pipeline_end(&pl);
+        handle_ota_failed_action(ota_actions);
+        return fota_resume_resp(req, ota_err, &resume);
+    }
+    ranged = ota_err == ESP_OK;
+    if (ranged) {
+        //X-Image-Hash is digest of whole image, not of this range
+        pl.digest.has_expected = false;
+        offset = resume.offset;
+        ESP_LOGI(TAG, "ranged upload at %u/%" PRIu32, offset, resume.size);
+    }
+#endif
+
+    ota_err = fota_ota_begin(update_partition, offset, &update_handle);
     if (ota_err != ESP_OK) {
+        esp_http_upload_pipeline_end(&pl);
         handle_ota_failed_action(ota_actions);
         ESP_LOGE(TAG, "esp_ota_begin failed: err=%d", ota_err);
         return esp_http_upload_json_status(req, ota_err, 0);
     }
 
     ESP_LOGI(TAG, "esp_ota_begin OK");
-    ESP_LOGI(TAG, "uploading firmware...");
 
-    //prepare buffer, keep in mind to free it before return call
-    char *buf = (char *)malloc(UPLOAD_BUF_LEN);
-    if (!buf) {
+    ota_err = fota_writer_begin(&image.writer, update_handle, update_partition, offset);
+    if (ota_err != ESP_OK) {
+        esp_http_upload_pipeline_end(&pl);
+        esp_ota_abort(update_handle);
+        handle_ota_failed_action(ota_actions);
+        return esp_http_upload_json_status(req, ota_err, 0);
+    }
+    esp_http_upload_pipeline_add(&pl, &fota_image_ops, &image);
+
+#ifdef CONFIG_HTTPD_FOTA_DELTA
+    if (delta) {
+        ota_err = esp_http_upload_patch_init(&patch, esp_ota_get_running_partition(), UPLOAD_PIPELINE_WRITE(&pl),
+                                             UPLOAD_PIPELINE_CTX(&pl));
+        if (ota_err == ESP_OK)
+            ota_err = esp_http_upload_pipeline_add(&pl, &esp_http_upload_patch_ops, &patch);
+    }
+#endif
+#ifdef CONFIG_HTTPD_FOTA_DECOMPRESS
+    compressed = fota_part_is_gzip(&pl.mp.part);
+    if (compressed && ota_err == ESP_OK) {
+        ota_err = esp_http_upload_inflate_init(&inflate, UPLOAD_PIPELINE_WRITE(&pl), UPLOAD_PIPELINE_CTX(&pl));
+        if (ota_err == ESP_OK)
+            ota_err = esp_http_upload_pipeline_add(&pl, &esp_http_upload_inflate_ops, &inflate);
+        ESP_LOGI(TAG, "gzip compressed firmware");
+    }
+#endif
+    if (ota_err != ESP_OK) {
+        esp_http_upload_pipeline_end(&pl);
+        fota_writer_end(&image.writer);
+        esp_ota_abort(update_handle);
         handle_ota_failed_action(ota_actions);
-        return esp_http_upload_json_status(req, ESP_ERR_NO_MEM, 0);
+        return esp_http_upload_json_status(req, ota_err, 0);
     }
+    ESP_LOGI(TAG, "uploading firmware...");
 
-    while (bytes_written < binary_size) {
-        if (bytes_left > UPLOAD_BUF_LEN)
-            to_read = MIN(bytes_left, UPLOAD_BUF_LEN);
-        else
-            to_read = bytes_left - (final_boundary_len + 4);
-
-        vTaskDelay(pdMS_TO_TICKS(10)); //yield to other tasks
-        recv = httpd_req_recv(req, buf, to_read);
-        if (recv < 0) {
-            // Retry receiving if timeout occurred
-            if (recv == HTTPD_SOCK_ERR_TIMEOUT) {
-                if (++timeout_retries < OTA_RECV_TIMEOUT_RETRIES)
-                    continue;
-
-                ESP_LOGE(TAG, "httpd_req_recv timed out after %d retries", OTA_RECV_TIMEOUT_RETRIES);
-                free(buf);
-                handle_ota_failed_action(ota_actions);
-                return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
+    fota_image_check_init(&image.check);
+    if (offset > 0)
+        image.check.done = true; //headers checked with first range
+    ota_err = esp_http_upload_pipeline_run(&pl);
+#ifdef CONFIG_HTTPD_FOTA_DECOMPRESS
+    if (compressed)
+        stats.bytes_decompressed = inflate.size;
+#endif
+
+    esp_err_t wr_err = fota_writer_end(&image.writer);
+    if (wr_err != ESP_OK)
+        ota_err = ESP_FAIL;
+
+#ifdef CONFIG_HTTPD_FOTA_RESUME
+    if (ranged) {
+        size_t end = offset + stats.bytes_uploaded;
+
+        if ((pl.dropped && wr_err == ESP_OK) || (ota_err == ESP_OK && end < resume.size)) {
+            //dropped connection or range done, image is incomplete
+            fota_resume_commit(&resume, image.check.done ? end : 0);
+            if (ota_err == ESP_OK) {
+                esp_ota_abort(update_handle);
+                return fota_resume_resp(req, ESP_OK, &resume);
             }
-            free(buf);
-            ESP_LOGE(TAG, "httpd_req_recv error: err=0x%x", recv);
-            handle_ota_failed_action(ota_actions);
-            return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
-        }
-        if (recv == 0) {
-            ESP_LOGE(TAG, "httpd_req_recv returned 0, client disconnected");
-            free(buf);
-            handle_ota_failed_action(ota_actions);
-            return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
-        }
-        timeout_retries = 0;
-        bytes_left -= recv;
-
-        ota_err = esp_ota_write(update_handle, (const void *)buf, recv);
-        if (ota_err != ESP_OK) {
-            free(buf);
-            ESP_LOGE(TAG, "esp_ota_write error: err=0x%x", recv);
-            handle_ota_failed_action(ota_actions);
-            return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
+        } else if (ota_err != ESP_OK) {
+            //written data is not trusted
+            fota_resume_save(NULL);
         }
-        bytes_written += recv;
-        ESP_LOGI(TAG, "firmware upload %d/%d bytes", bytes_written, binary_size);
     }
-    free(buf);
+#endif
 
-    bytes_read = esp_http_upload_check_final_boundary(req, boundary, bytes_left);
-    if (bytes_read > 0) {
-        bytes_left -= bytes_read;
-    } else {
+    if (ota_err == ESP_ERR_IMAGE_INVALID || ota_err == ESP_ERR_INVALID_VERSION ||
+        ota_err == ESP_ERR_INVALID_RESPONSE) {
+        //wrong image, do not receive the rest of it
+        esp_ota_abort(update_handle);
         handle_ota_failed_action(ota_actions);
-        return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
+        return esp_http_upload_abort(req, ota_err, &stats);
     }
-    ESP_LOGI(TAG, "%d firmware bytes uploaded OK", bytes_written);
 
-    ota_err = esp_ota_end(update_handle);
     if (ota_err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_ota_end failed! err=0x%x. Image is invalid", ota_err);
+        esp_ota_abort(update_handle);
         handle_ota_failed_action(ota_actions);
-        return esp_http_upload_json_status(req, ota_err, bytes_written);
+        return esp_http_upload_json_stats(req, ota_err, &stats);
     }
 
-#ifdef CONFIG_APP_UPDATE_CHECK_PROJECT_NAME
-    const esp_app_desc_t *app_descr = esp_ota_get_app_description();
-    esp_app_desc_t update_descr;
-
-    ota_err = esp_httpd_fota_get_partition_descr(update_partition, &update_descr);
-    if (ota_err == ESP_OK) {
-        ESP_LOGW(TAG, "new firmware: %s ver %s %s %s", update_descr.project_name, update_descr.version, update_descr.date,
-                 update_descr.time);
-    } else {
-        ESP_LOGE(TAG, "get_partition_descr failed! err=0x%x %s", ota_err, esp_err_to_name(ota_err));
+    if (!image.check.done) {
+        ESP_LOGE(TAG, "image too short, app description not found");
+        esp_ota_abort(update_handle);
         handle_ota_failed_action(ota_actions);
-        return esp_http_upload_json_status(req, ESP_ERR_IMAGE_INVALID, 0);
+        return esp_http_upload_json_stats(req, ESP_ERR_IMAGE_INVALID, &stats);
     }
 
-    if (strcmp(app_descr->project_name, update_descr.project_name) == 0) {
-        ESP_LOGI(TAG, "PROJECT_NAME: check OK");
-    } else {
-        ESP_LOGE(TAG, "update PROJECT_NAME != %s", app_descr->project_name);
+    if (stats.bytes_uploaded == 0) {
+        ESP_LOGE(TAG, "no file uploaded");
+        esp_ota_abort(update_handle);
         handle_ota_failed_action(ota_actions);
-        return esp_http_upload_json_status(req, ESP_ERR_IMAGE_INVALID, 0);
+        return esp_http_upload_json_status(req, ESP_ERR_NOT_FOUND, 0);
     }
+    ESP_LOGI(TAG, "%d firmware bytes uploaded OK", stats.bytes_uploaded);
+
+#ifdef CONFIG_HTTPD_FOTA_RESUME
+    if (ranged)
+        fota_resume_save(NULL); //image complete, valid or not
 #endif
+    return fota_activate(req, update_handle, update_partition, ota_actions, &stats);
+}
 
-    ota_err = esp_ota_set_boot_partition(update_partition);
-    if (ota_err != ESP_OK) {
+//one writer of update partition, refused before body is received
+static esp_err_t fota_upload_admit(httpd_req_t *req, bool delta)
+{
+    esp_http_upload_ticket_t ticket = {
+        .part = esp_ota_get_next_update_partition(NULL),
+        .heap = UPLOAD_BUF_LEN + FOTA_WRITER_HEAP,
+    };
+    esp_err_t rc;
+
+#ifdef CONFIG_HTTPD_FOTA_DECOMPRESS
+    ticket.heap += INFLATE_HEAP; //not known if image is compressed until part headers arrive
+#endif
+#ifdef CONFIG_HTTPD_FOTA_DELTA
+    if (delta)
+        ticket.heap += PATCH_BUF_LEN;
+#endif
+    rc = esp_http_upload_admit(req, &ticket);
+    if (rc != ESP_OK)
+        return esp_http_upload_busy(req, rc);
+
+    rc = fota_upload(req, delta);
+    esp_http_upload_release(&ticket);
+    return rc;
+}
+
+esp_err_t esp_httpd_fota_handler(httpd_req_t *req)
+{
+    if (esp_httpd_async_detach(req, esp_httpd_fota_handler) == ESP_OK)
+        return ESP_OK;
+    return fota_upload_admit(req, false);
+}
+
+#ifdef CONFIG_HTTPD_FOTA_DELTA
+esp_err_t esp_httpd_fota_delta_handler(httpd_req_t *req)
+{
+    if (esp_httpd_async_detach(req, esp_httpd_fota_delta_handler) == ESP_OK)
+        return ESP_OK;
+    return fota_upload_admit(req, true);
+}
+#endif
+
+#ifdef CONFIG_HTTPD_FOTA_RANGED
+#define FOTA_RANGE_SIZE CONFIG_HTTPD_FOTA_RANGE_SIZE
+_Static_assert(FOTA_RANGE_SIZE % SPI_FLASH_SEC_SIZE == 0, "range must cover whole flash sectors");
+
+/* Ranged upload: image is split into FOTA_RANGE_SIZE ranges sent in any order
+over several connections. Every range owns its flash sectors, so ranges are
+erased and written independently. Update is finished when all ranges are
+written. */
+typedef struct {
+    esp_ota_handle_t handle;
+    const esp_partition_t *part;
+    esp_ota_actions_t *ota_actions;
+    uint32_t size;
+    uint8_t hash[32];
+    uint32_t *done;     //bitmap of written ranges
+    uint32_t *busy;     //bitmap of ranges being received
+    size_t ranges;      //number of ranges
+    size_t ranges_done; //number of written ranges
+} fota_ranged_t;
+
+static fota_ranged_t fota_ranged;
+
+static SemaphoreHandle_t fota_ranged_lock(void)
+{
+    static StaticSemaphore_t lock_buf;
+    static SemaphoreHandle_t lock;
+    static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    taskENTER_CRITICAL(&mux);
+    if (!lock)
+        lock = xSemaphoreCreateMutexStatic(&lock_buf);
+    taskEXIT_CRITICAL(&mux);
+    return lock;
+}
+
+static bool fota_ranged_test(const uint32_t *bitmap, size_t first, size_t last)
+{
+    for (size_t i = first; i <= last; i++) {
+        if (bitmap[i / 32] & (1u << i % 32))
+            return true;
+    }
+    return false;
+}
+
+//set or clear bits, return number of changed bits
+static size_t fota_ranged_mark(uint32_t *bitmap, size_t first, size_t last, bool set)
+{
+    size_t changed = 0;
+
+    for (size_t i = first; i <= last; i++) {
+        uint32_t old = bitmap[i / 32];
+        if (set)
+            bitmap[i / 32] |= 1u << i % 32;
+        else
+            bitmap[i / 32] &= ~(1u << i % 32);
+        changed += old != bitmap[i / 32];
+    }
+    return changed;
+}
+
+//release upload state, call with lock held
+static void fota_ranged_end(fota_ranged_t *up, bool failed)
+{
+    if (failed) {
+        esp_ota_abort(up->handle);
+        handle_ota_failed_action(up->ota_actions);
+    }
+    free(up->done);
+    free(up->busy);
+    memset(up, 0, sizeof(fota_ranged_t));
+}
+
+//start upload of new image, call with lock held
+static esp_err_t fota_ranged_begin(fota_ranged_t *up, const fota_range_t *range, esp_ota_actions_t *ota_actions)
+{
+    esp_err_t err;
+
+    if (up->done) {
+        //another image was being uploaded, keep it while its ranges are received
+        if (fota_ranged_test(up->busy, 0, up->ranges - 1)) {
+            ESP_LOGE(TAG, "ranges of another image are being received");
+            return ESP_ERR_INVALID_STATE;
+        }
+        ESP_LOGW(TAG, "ranged upload of previous image dropped");
+        fota_ranged_end(up, true);
+    }
+
+    if (ota_actions && ota_actions->on_update_init)
+        ota_actions->on_update_init(ota_actions->arg);
+
+    up->part = esp_ota_get_next_update_partition(NULL);
+    if (!up->part) {
+        ESP_LOGE(TAG, "update part not found");
         handle_ota_failed_action(ota_actions);
-        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed! err=0x%x", ota_err);
-        return esp_http_upload_json_status(req, ota_err, bytes_written);
+        return ESP_FAIL;
+    }
+    if (range->size > up->part->size) {
+        ESP_LOGE(TAG, "image size %" PRIu32 " > partition size %" PRIu32, range->size, up->part->size);
+        handle_ota_failed_action(ota_actions);
+        return ESP_ERR_INVALID_SIZE;
     }
 
-    //do after update complete action
-    if (ota_actions && ota_actions->on_update_complete)
-        ota_actions->on_update_complete(ota_actions->arg);
+    up->ranges = (range->size + FOTA_RANGE_SIZE - 1) / FOTA_RANGE_SIZE;
+    up->done = calloc((up->ranges + 31) / 32, sizeof(uint32_t));
+    up->busy = calloc((up->ranges + 31) / 32, sizeof(uint32_t));
+    if (!up->done || !up->busy) {
+        fota_ranged_end(up, false);
+        handle_ota_failed_action(ota_actions);
+        return ESP_ERR_NO_MEM;
+    }
 
-    esp_http_upload_json_status(req, ESP_OK, bytes_written);
+    err = fota_ota_begin(up->part, 0, &up->handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed: err=%d", err);
+        fota_ranged_end(up, false);
+        handle_ota_failed_action(ota_actions);
+        return err;
+    }
 
-    if (ota_actions && ota_actions->skip_reboot) {
-        ESP_LOGI(TAG, "reboot skipped");
-    } else {
-        ESP_LOGI(TAG, "esp reboot..");
-        vTaskDelay(1000 / portTICK_PERIOD_MS); //let esp send response before reboot
-        esp_restart();
+    up->ota_actions = ota_actions;
+    up->size = range->size;
+    memcpy(up->hash, range->hash, sizeof(up->hash));
+    ESP_LOGI(TAG, "ranged upload of %" PRIu32 " bytes in %u ranges to %s", up->size, up->ranges, up->part->label);
+    return ESP_OK;
+}
+
+//hash image written by all ranges, X-Image-Hash names whole uploaded image
+static esp_err_t fota_ranged_verify(const fota_ranged_t *up)
+{
+    esp_http_upload_digest_t digest = { .has_expected = true };
+    esp_err_t err = ESP_OK;
+    char *buf;
+
+    buf = malloc(UPLOAD_BUF_LEN);
+    if (!buf)
+        return ESP_ERR_NO_MEM;
+
+    memcpy(digest.expected, up->hash, sizeof(digest.expected));
+    esp_http_upload_digest_start(&digest);
+    for (uint32_t offset = 0; offset < up->size && err == ESP_OK; offset += UPLOAD_BUF_LEN) {
+        size_t len = MIN(UPLOAD_BUF_LEN, up->size - offset);
+        err = esp_partition_read(up->part, offset, buf, len);
+        if (err == ESP_OK)
+            esp_http_upload_digest_update(&digest, buf, len);
+    }
+    free(buf);
+
+    esp_err_t crc = esp_http_upload_digest_finish(&digest);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_partition_read failed: err=%d", err);
+        return err;
+    }
+    return crc;
+}
+
+//claim ranges for request, start upload on first range of new image
+static esp_err_t fota_ranged_claim(fota_ranged_t *up, const fota_range_t *range, esp_ota_actions_t *ota_actions)
+{
+    size_t first = range->first / FOTA_RANGE_SIZE;
+    size_t last = range->last / FOTA_RANGE_SIZE;
+    esp_err_t err;
+
+    if (range->first % FOTA_RANGE_SIZE != 0 || ((range->last + 1) % FOTA_RANGE_SIZE != 0 && range->last + 1 != range->size)) {
+        ESP_LOGE(TAG, "range %" PRIu32 "-%" PRIu32 " not aligned to %d", range->first, range->last, FOTA_RANGE_SIZE);
+        return ESP_ERR_INVALID_ARG;
     }
+
+    if (!up->done || up->size != range->size || memcmp(up->hash, range->hash, sizeof(up->hash)) != 0) {
+        err = fota_ranged_begin(up, range, ota_actions);
+        if (err != ESP_OK)
+            return err;
+    }
+
+    if (fota_ranged_test(up->busy, first, last)) {
+        ESP_LOGE(TAG, "range %" PRIu32 "-%" PRIu32 " is being received", range->first, range->last);
+        return ESP_ERR_INVALID_STATE;
+    }
+    fota_ranged_mark(up->busy, first, last, true);
     return ESP_OK;
 }
+
+static esp_err_t fota_ranged_resp(httpd_req_t *req, esp_err_t rc, size_t uploaded, const fota_ranged_t *up)
+{
+    esp_httpd_json_t jw;
+    char buf[32];
+    sprintf(buf, "%u", uploaded);
+
+    if (rc != ESP_OK) {
+        //request body is not received
+        if (rc == ESP_ERR_INVALID_STATE)
+            httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_set_hdr(req, "Connection", "close");
+    }
+
+    esp_httpd_json_begin(&jw, req);
+    esp_httpd_json_string(&jw, "result", esp_err_to_name(rc));
+    esp_httpd_json_string(&jw, "bytes_uploaded", buf);
+    esp_httpd_json_int(&jw, "ranges_done", up->ranges_done);
+    esp_httpd_json_int(&jw, "ranges", up->ranges);
+    esp_httpd_json_int(&jw, "range_size", FOTA_RANGE_SIZE);
+    esp_err_t err = esp_httpd_json_end(&jw);
+    return rc == ESP_OK ? err : ESP_FAIL;
+}
+
+//range sink, refuses data past the end of Content-Range
+typedef struct {
+    fota_image_t image;
+    size_t left;
+} fota_range_sink_t;
+
+static esp_err_t fota_range_write(void *ctx, const char *data, size_t len)
+{
+    fota_range_sink_t *sink = ctx;
+
+    if (len > sink->left) {
+        ESP_LOGE(TAG, "range data longer than Content-Range");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    sink->left -= len;
+    return fota_image_write(&sink->image, data, len);
+}
+
+static const esp_http_upload_stage_ops_t fota_range_ops = {
+    .write = fota_range_write,
+};
+
+static esp_err_t fota_ranged_upload(httpd_req_t *req)
+{
+    SemaphoreHandle_t lock = fota_ranged_lock();
+    fota_ranged_t *up = &fota_ranged;
+    esp_ota_actions_t *ota_actions = req->user_ctx;
+    esp_http_upload_pipeline_t pl;
+    esp_http_upload_stats_t stats = { 0 };
+    fota_range_sink_t sink;
+    fota_range_t range;
+    uint8_t installed[UPLOAD_DIGEST_LEN];
+    esp_err_t ota_err;
+
+    ota_err = fota_range_parse(req, &range);
+    if (ota_err != ESP_OK)
+        return esp_http_upload_json_status(req, ota_err == ESP_ERR_NOT_FOUND ? ESP_ERR_INVALID_ARG : ota_err, 0);
+
+    if (fota_installed(req, installed))
+        return esp_http_upload_not_modified(req, installed);
+
+    ota_err = esp_http_upload_pipeline_begin(&pl, req, &stats);
+    if (ota_err != ESP_OK)
+        return esp_http_upload_json_status(req, ota_err, 0);
+    //X-Image-Hash is digest of whole image, not of this range
+    pl.digest.has_expected = false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    ota_err = fota_ranged_claim(up, &range, ota_actions);
+    if (ota_err == ESP_OK) {
+        ota_err = fota_writer_begin(&sink.image.writer, up->handle, up->part, range.first);
+        if (ota_err != ESP_OK)
+            fota_ranged_mark(up->busy, range.first / FOTA_RANGE_SIZE, range.last / FOTA_RANGE_SIZE, false);
+    }
+    xSemaphoreGive(lock);
+    if (ota_err != ESP_OK) {
+        esp_http_upload_pipeline_end(&pl);
+        return fota_ranged_resp(req, ota_err, 0, up);
+    }
+    ESP_LOGI(TAG, "range %" PRIu32 "-%" PRIu32 "/%" PRIu32, range.first, range.last, range.size);
+
+    //image headers are checked in first range
+    fota_image_check_init(&sink.image.check);
+    sink.image.check.done = range.first > 0;
+    sink.left = range.last - range.first + 1;
+    esp_http_upload_pipeline_add(&pl, &fota_range_ops, &sink);
+    ota_err = esp_http_upload_pipeline_run(&pl);
+
+    size_t uploaded = stats.bytes_uploaded;
+    if (fota_writer_end(&sink.image.writer) != ESP_OK) {
+        ota_err = ESP_FAIL;
+    } else if (pl.dropped || (ota_err == ESP_OK && uploaded != range.last - range.first + 1)) {
+        ESP_LOGE(TAG, "range incomplete, %u bytes received", uploaded);
+        ota_err = ESP_ERR_INVALID_SIZE;
+    } else if (ota_err == ESP_OK && !sink.image.check.done) {
+        //later ranges are not checked, description must be in first one
+        ESP_LOGE(TAG, "app description not found in first range");
+        ota_err = ESP_ERR_IMAGE_INVALID;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (up->size != range.size || memcmp(up->hash, range.hash, sizeof(up->hash)) != 0) {
+        //upload replaced by another image meanwhile
+        xSemaphoreGive(lock);
+        return fota_ranged_resp(req, ESP_ERR_INVALID_STATE, uploaded, up);
+    }
+
+    size_t first = range.first / FOTA_RANGE_SIZE;
+    size_t last = range.last / FOTA_RANGE_SIZE;
+    fota_ranged_mark(up->busy, first, last, false);
+
+    if (ota_err == ESP_ERR_IMAGE_INVALID || ota_err == ESP_ERR_INVALID_VERSION) {
+        //wrong image, drop whole upload
+        fota_ranged_end(up, true);
+        xSemaphoreGive(lock);
+        return esp_http_upload_abort(req, ota_err, &(esp_http_upload_stats_t){ .bytes_uploaded = uploaded });
+    }
+
+    if (ota_err != ESP_OK) {
+        //range can be sent again
+        xSemaphoreGive(lock);
+        return fota_ranged_resp(req, ota_err, uploaded, up);
+    }
+
+    up->ranges_done += fota_ranged_mark(up->done, first, last, true);
+    ESP_LOGI(TAG, "%u/%u ranges uploaded", up->ranges_done, up->ranges);
+
+    if (up->ranges_done < up->ranges) {
+        xSemaphoreGive(lock);
+        return fota_ranged_resp(req, ESP_OK, uploaded, up);
+    }
+
+    //last range, no other request holds upload state
+    ota_err = fota_ranged_verify(up);
+    if (ota_err != ESP_OK) {
+        fota_ranged_end(up, true);
+        xSemaphoreGive(lock);
+        return esp_http_upload_json_stats(req, ota_err, &(esp_http_upload_stats_t){ .bytes_uploaded = uploaded });
+    }
+
+    esp_ota_handle_t handle = up->handle;
+    const esp_partition_t *part = up->part;
+    fota_ranged_end(up, false);
+    xSemaphoreGive(lock);
+
+    return fota_activate(req, handle, part, ota_actions, &(esp_http_upload_stats_t){ .bytes_uploaded = uploaded });
+}
+
+//ranges share update partition, full image upload is refused meanwhile
+esp_err_t esp_httpd_fota_ranged_handler(httpd_req_t *req)
+{
+    esp_http_upload_ticket_t ticket = {
+        .part = esp_ota_get_next_update_partition(NULL),
+        .heap = UPLOAD_BUF_LEN + FOTA_WRITER_HEAP,
+        .shared = true,
+    };
+    esp_err_t rc;
+
+    if (esp_httpd_async_detach(req, esp_httpd_fota_ranged_handler) == ESP_OK)
+        return ESP_OK;
+
+    rc = esp_http_upload_admit(req, &ticket);
+    if (rc != ESP_OK)
+        return esp_http_upload_busy(req, rc);
+
+    rc = fota_ranged_upload(req);
+    esp_http_upload_release(&ticket);
+    return rc;
+}
+#endif
@@ -4,18 +4,622 @@
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_idf_version.h>
+#include <esp_log.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+#include <inttypes.h>
+#include <string.h>
+
 #include "include/esp_http_server_misc.h"
 
+//async request handlers appeared in ESP-IDF 5.1
+#if defined(CONFIG_HTTPD_ASYNC_HANDLERS) && ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+#define HTTPD_ASYNC_WORKERS CONFIG_HTTPD_ASYNC_WORKERS
+#endif
+
+//RFC 8949 major types and simple values
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_TEXT 3
+#define CBOR_ARRAY_START 0x9f //indefinite length array
+#define CBOR_MAP_START 0xbf   //indefinite length map
+#define CBOR_FALSE 0xf4
+#define CBOR_TRUE 0xf5
+#define CBOR_NULL 0xf6
+#define CBOR_FLOAT64 0xfb
+#define CBOR_BREAK 0xff
+
+static void json_flush(esp_httpd_json_t *jw)
+{
+    if (jw->err == ESP_OK && jw->len > 0) {
+        if (!jw->out) {
+            jw->err = httpd_resp_send_chunk(jw->req, jw->buf, jw->len);
+        } else if (jw->out_len + jw->len <= jw->out_size) {
+            memcpy(jw->out + jw->out_len, jw->buf, jw->len);
+            jw->out_len += jw->len;
+        } else {
+            jw->err = ESP_ERR_INVALID_SIZE;
+        }
+    }
+    jw->len = 0;
+}
+
+static void json_putc(esp_httpd_json_t *jw, char c)
+{
+    if (jw->len == sizeof(jw->buf))
+        json_flush(jw);
+    jw->buf[jw->len++] = c;
+}
+
+static void json_puts(esp_httpd_json_t *jw, const char *s)
+{
+    while (*s)
+        json_putc(jw, *s++);
+}
+
+//CBOR item head, argument in shortest form
+static void cbor_head(esp_httpd_json_t *jw, uint8_t major, uint64_t value)
+{
+    int bytes;
+
+    major <<= 5;
+    if (value < 24) {
+        json_putc(jw, major | value);
+        return;
+    } else if (value <= UINT8_MAX) {
+        json_putc(jw, major | 24);
+        bytes = 1;
+    } else if (value <= UINT16_MAX) {
+        json_putc(jw, major | 25);
+        bytes = 2;
+    } else if (value <= UINT32_MAX) {
+        json_putc(jw, major | 26);
+        bytes = 4;
+    } else {
+        json_putc(jw, major | 27);
+        bytes = 8;
+    }
+    while (bytes--)
+        json_putc(jw, value >> (8 * bytes));
+}
+
+static void cbor_text(esp_httpd_json_t *jw, const char *s)
+{
+    cbor_head(jw, CBOR_TEXT, strlen(s));
+    json_puts(jw, s);
+}
+
+static void json_quoted(esp_httpd_json_t *jw, const char *s)
+{
+    char esc[8];
+
+    if (jw->cbor) {
+        cbor_text(jw, s);
+        return;
+    }
+    json_putc(jw, '"');
+    for (; *s; s++) {
+        unsigned char c = *s;
+        switch (c) {
+        case '"':
+        case '\\':
+            json_putc(jw, '\\');
+            json_putc(jw, c);
+            break;
+        case '\n':
+            json_puts(jw, "\\n");
+            break;
+        case '\r':
+            json_puts(jw, "\\r");
+            break;
+        case '\t':
+            json_puts(jw, "\\t");
+            break;
+        default:
+            if (c < ' ') {
+                sprintf(esc, "\\u%04x", c);
+                json_puts(jw, esc);
+            } else {
+                json_putc(jw, c);
+            }
+        }
+    }
+    json_putc(jw, '"');
+}
+
+//separator and name of next member at current level
+static void json_member(esp_httpd_json_t *jw, const char *key)
+{
+    uint32_t level = 1u << jw->depth;
+
+    if (jw->cbor) {
+        //indefinite length containers need no separators
+        if (key)
+            cbor_text(jw, key);
+        return;
+    }
+    if (jw->nonempty & level)
+        json_putc(jw, ',');
+    jw->nonempty |= level;
+    if (key) {
+        json_quoted(jw, key);
+        json_putc(jw, ':');
+    }
+}
+
+static void json_open(esp_httpd_json_t *jw, const char *key, bool array)
+{
+    if (jw->depth == HTTPD_JSON_MAX_DEPTH) {
+        jw->err = ESP_ERR_INVALID_SIZE;
+        return;
+    }
+    json_member(jw, key);
+    if (jw->cbor)
+        json_putc(jw, array ? CBOR_ARRAY_START : CBOR_MAP_START);
+    else
+        json_putc(jw, array ? '[' : '{');
+    jw->depth++;
+
+    uint32_t level = 1u << jw->depth;
+    jw->nonempty &= ~level;
+    if (array)
+        jw->arrays |= level;
+    else
+        jw->arrays &= ~level;
+}
+
+bool esp_httpd_json_accepts_cbor(httpd_req_t *req)
+{
+    char accept[96];
+
+    //longer header is truncated, CBOR asked by tools is listed first
+    if (httpd_req_get_hdr_value_len(req, "Accept") == 0)
+        return false;
+    httpd_req_get_hdr_value_str(req, "Accept", accept, sizeof(accept));
+    return strstr(accept, HTTPD_TYPE_CBOR) != NULL;
+}
+
+static void json_start(esp_httpd_json_t *jw, httpd_req_t *req)
+{
+    memset(jw, 0, sizeof(esp_httpd_json_t));
+    jw->req = req;
+    jw->cbor = esp_httpd_json_accepts_cbor(req);
+    httpd_resp_set_type(req, jw->cbor ? HTTPD_TYPE_CBOR : HTTPD_TYPE_JSON);
+    httpd_resp_set_hdr(req, "Vary", "Accept");
+}
+
+void esp_httpd_json_begin(esp_httpd_json_t *jw, httpd_req_t *req)
+{
+    json_start(jw, req);
+    json_open(jw, NULL, false);
+}
+
+void esp_httpd_json_begin_buf(esp_httpd_json_t *jw, httpd_req_t *req, char *buf, size_t size)
+{
+    //response headers are left to whoever sends the buffer
+    memset(jw, 0, sizeof(esp_httpd_json_t));
+    jw->req = req;
+    jw->cbor = req && esp_httpd_json_accepts_cbor(req);
+    jw->out = buf;
+    jw->out_size = size;
+    json_open(jw, NULL, false);
+}
+
+esp_err_t esp_httpd_json_end(esp_httpd_json_t *jw)
+{
+    while (jw->depth > 0)
+        esp_httpd_json_close(jw);
+    json_flush(jw);
+    if (jw->err == ESP_OK && !jw->out)
+        jw->err = httpd_resp_send_chunk(jw->req, NULL, 0);
+    return jw->err;
+}
+
+void esp_httpd_json_object(esp_httpd_json_t *jw, const char *key)
+{
+    json_open(jw, key, false);
+}
+
+void esp_httpd_json_array(esp_httpd_json_t *jw, const char *key)
+{
+    json_open(jw, key, true);
+}
+
+void esp_httpd_json_close(esp_httpd_json_t *jw)
+{
+    if (jw->depth == 0)
+        return;
+    if (jw->cbor)
+        json_putc(jw, CBOR_BREAK);
+    else
+        json_putc(jw, jw->arrays & (1u << jw->depth) ? ']' : '}');
+    jw->depth--;
+}
+
+void esp_httpd_json_string(esp_httpd_json_t *jw, const char *key, const char *value)
+{
+    json_member(jw, key);
+    json_quoted(jw, value ? value : "");
+}
+
+void esp_httpd_json_int(esp_httpd_json_t *jw, const char *key, long value)
+{
+    char buf[24];
+
+    json_member(jw, key);
+    if (jw->cbor) {
+        if (value < 0)
+            cbor_head(jw, CBOR_NEGATIVE, -1 - (int64_t)value);
+        else
+            cbor_head(jw, CBOR_UNSIGNED, value);
+        return;
+    }
+    sprintf(buf, "%ld", value);
+    json_puts(jw, buf);
+}
+
+void esp_httpd_json_bool(esp_httpd_json_t *jw, const char *key, bool value)
+{
+    json_member(jw, key);
+    if (jw->cbor)
+        json_putc(jw, value ? CBOR_TRUE : CBOR_FALSE);
+    else
+        json_puts(jw, value ? "true" : "false");
+}
+
+static void json_null(esp_httpd_json_t *jw, const char *key)
+{
+    json_member(jw, key);
+    if (jw->cbor)
+        json_putc(jw, CBOR_NULL);
+    else
+        json_puts(jw, "null");
+}
+
+static void json_double(esp_httpd_json_t *jw, const char *key, double value)
+{
+    char buf[32];
+
+    if (!isfinite(value)) {
+        json_null(jw, key); //as cJSON prints it
+        return;
+    }
+    if (value >= LONG_MIN && value <= LONG_MAX && value == (long)value) {
+        esp_httpd_json_int(jw, key, value);
+        return;
+    }
+    json_member(jw, key);
+    if (jw->cbor) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        json_putc(jw, CBOR_FLOAT64);
+        for (int i = 7; i >= 0; i--)
+            json_putc(jw, bits >> (8 * i));
+        return;
+    }
+    //shortest text which reads back as same double, as cJSON prints it
+    sprintf(buf, "%1.15g", value);
+    if (strtod(buf, NULL) != value)
+        sprintf(buf, "%1.17g", value);
+    json_puts(jw, buf);
+}
+
+static void json_tree(esp_httpd_json_t *jw, const char *key, const cJSON *js)
+{
+    const cJSON *it;
+
+    if (cJSON_IsObject(js) || cJSON_IsArray(js)) {
+        bool array = cJSON_IsArray(js);
+        json_open(jw, key, array);
+        cJSON_ArrayForEach(it, js)
+            json_tree(jw, array ? NULL : it->string, it);
+        esp_httpd_json_close(jw);
+    } else if (cJSON_IsString(js)) {
+        esp_httpd_json_string(jw, key, js->valuestring);
+    } else if (cJSON_IsNumber(js)) {
+        json_double(jw, key, js->valuedouble);
+    } else if (cJSON_IsBool(js)) {
+        esp_httpd_json_bool(jw, key, cJSON_IsTrue(js));
+    } else {
+        json_null(jw, key);
+    }
+}
+
 esp_err_t esp_httpd_resp_json(httpd_req_t *req, cJSON *js)
 {
+    esp_httpd_json_t jw;
+
     CHECK_ARG(js);
     CHECK_ARG(req);
 
-    char *js_txt = cJSON_Print(js);
+    //tree is encoded as client accepts it, without printed copy in heap
+    json_start(&jw, req);
+    json_tree(&jw, NULL, js);
     cJSON_Delete(js);
+    return esp_httpd_json_end(&jw);
+}
+
+static bool etag_listed(const char *list, const char *etag)
+{
+    const char *tag, *end;
+
+    for (tag = list; *tag; tag = *end ? end + 1 : end) {
+        while (*tag == ' ' || *tag == '\t')
+            tag++;
+        end = strchr(tag, ',');
+        if (!end)
+            end = tag + strlen(tag);
+
+        size_t len = end - tag;
+        while (len && (tag[len - 1] == ' ' || tag[len - 1] == '\t'))
+            len--;
+        //weak comparison, as for GET
+        if (len > 2 && tag[0] == 'W' && tag[1] == '/') {
+            tag += 2;
+            len -= 2;
+        }
+        if ((len == 1 && tag[0] == '*') || (len == strlen(etag) && !strncmp(tag, etag, len)))
+            return true;
+    }
+    return false;
+}
+
+bool esp_httpd_resp_not_modified(httpd_req_t *req, char etag[HTTPD_ETAG_LEN], const char *tag)
+{
+    char *hdr;
+    bool match = false;
+
+    //representations of both encodings need own tags
+    snprintf(etag, HTTPD_ETAG_LEN, "\"%s%s\"", tag, esp_httpd_json_accepts_cbor(req) ? "-cbor" : "");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    size_t hdr_len = httpd_req_get_hdr_value_len(req, "If-None-Match");
+    if (!hdr_len)
+        return false;
+    hdr = malloc(hdr_len + 1);
+    if (!hdr)
+        return false;
+    httpd_req_get_hdr_value_str(req, "If-None-Match", hdr, hdr_len + 1);
+    match = etag_listed(hdr, etag);
+    free(hdr);
+
+    if (match) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "Vary", "Accept");
+        httpd_resp_send(req, NULL, 0);
+    }
+    return match;
+}
+
+//FNV-1a, tells apart documents, nothing more
+static uint32_t etag_hash(const char *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= (uint8_t)*data++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+esp_err_t esp_httpd_resp_json_etag(httpd_req_t *req, esp_httpd_json_render_t render, void *arg)
+{
+    esp_httpd_json_t jw;
+    char body[HTTPD_ETAG_BODY_LEN];
+    char etag[HTTPD_ETAG_LEN];
+    char tag[12];
+
+    CHECK_ARG(req);
+    CHECK_ARG(render);
+
+    //tag must describe the very body sent, so document is rendered once into buffer
+    esp_httpd_json_begin_buf(&jw, req, body, sizeof(body));
+    render(&jw, arg);
+    if (esp_httpd_json_end(&jw) != ESP_OK) {
+        //too large to tag, stream it
+        esp_httpd_json_begin(&jw, req);
+        render(&jw, arg);
+        return esp_httpd_json_end(&jw);
+    }
+
+    sprintf(tag, "%08" PRIx32, etag_hash(body, jw.out_len));
+    if (esp_httpd_resp_not_modified(req, etag, tag))
+        return ESP_OK;
+
+    httpd_resp_set_type(req, jw.cbor ? HTTPD_TYPE_CBOR : HTTPD_TYPE_JSON);
+    httpd_resp_set_hdr(req, "Vary", "Accept");
+    return httpd_resp_send(req, body, jw.out_len);
+}
+
+//include list has bare name (field NULL), name.field, or any name.x (field "")
+static bool batch_listed(const char *include, const char *name, const char *field)
+{
+    const char *tok, *end;
+    size_t name_len = strlen(name);
+
+    for (tok = include; *tok; tok = *end ? end + 1 : end) {
+        end = strchr(tok, ',');
+        if (!end)
+            end = tok + strlen(tok);
+        if (end - tok < name_len || strncmp(tok, name, name_len))
+            continue;
 
-    httpd_resp_set_type(req, HTTPD_TYPE_JSON);
-    httpd_resp_send(req, js_txt, -1);
-    free(js_txt);
+        const char *rest = tok + name_len;
+        size_t rest_len = end - rest;
+        if (!field) {
+            if (rest_len == 0)
+                return true;
+        } else if (rest_len > 1 && rest[0] == '.' &&
+                   (!field[0] || (rest_len - 1 == strlen(field) && !strncmp(rest + 1, field, rest_len - 1)))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool esp_httpd_batch_field(const esp_httpd_batch_t *sel, const char *field, bool by_default)
+{
+    if (!sel || !sel->include)
+        return by_default;
+    return batch_listed(sel->include, sel->name, field) ||
+           (by_default && batch_listed(sel->include, sel->name, NULL));
+}
+
+esp_err_t esp_httpd_batch_handler(httpd_req_t *req)
+{
+    const esp_httpd_batch_section_t *sections = req->user_ctx;
+    esp_httpd_batch_t sel = { 0 };
+    esp_httpd_json_t jw;
+    char query[HTTPD_BATCH_INCLUDE_LEN + 16];
+    char include[HTTPD_BATCH_INCLUDE_LEN];
+    esp_err_t rc;
+
+    CHECK_ARG(sections);
+
+    if (httpd_req_get_url_query_len(req) > 0) {
+        rc = httpd_req_get_url_query_str(req, query, sizeof(query));
+        if (rc == ESP_OK)
+            rc = httpd_query_key_value(query, "include", include, sizeof(include));
+        if (rc == ESP_OK) {
+            //commas escaped by URLSearchParams
+            for (char *r = include, *w = include;;) {
+                if (r[0] == '%' && r[1] == '2' && (r[2] == 'C' || r[2] == 'c')) {
+                    *w++ = ',';
+                    r += 3;
+                } else if (!(*w++ = *r++)) {
+                    break;
+                }
+            }
+            sel.include = include;
+        } else if (rc != ESP_ERR_NOT_FOUND) {
+            return httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, "include list too long");
+        }
+    }
+
+    esp_httpd_json_begin(&jw, req);
+    for (const esp_httpd_batch_section_t *sec = sections; sec->name; sec++) {
+        if (sel.include && !batch_listed(sel.include, sec->name, NULL) && !batch_listed(sel.include, sec->name, ""))
+            continue;
+        sel.name = sec->name;
+        esp_httpd_json_object(&jw, sec->name);
+        sec->render(&jw, &sel, sec->arg);
+        esp_httpd_json_close(&jw);
+    }
+    return esp_httpd_json_end(&jw);
+}
+
+#ifdef HTTPD_ASYNC_WORKERS
+static const char *TAG = "HTTPD";
+
+typedef struct {
+    httpd_req_t *req;
+    esp_err_t (*handler)(httpd_req_t *req);
+} httpd_async_job_t;
+
+static QueueHandle_t async_jobs;
+static SemaphoreHandle_t async_idle; //counts workers waiting for a job
+static TaskHandle_t async_workers[HTTPD_ASYNC_WORKERS];
+
+static void httpd_async_worker(void *arg)
+{
+    httpd_async_job_t job;
+
+    while (true) {
+        xQueueReceive(async_jobs, &job, portMAX_DELAY);
+        //failed handler closes connection like it does in HTTPD task
+        if (job.handler(job.req) != ESP_OK)
+            httpd_sess_trigger_close(job.req->handle, httpd_req_to_sockfd(job.req));
+        httpd_req_async_handler_complete(job.req);
+        xSemaphoreGive(async_idle);
+    }
+}
+
+//workers are started on first detached request
+static esp_err_t httpd_async_init(void)
+{
+    static StaticSemaphore_t lock_buf;
+    static SemaphoreHandle_t lock;
+    static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    esp_err_t rc = ESP_OK;
+
+    taskENTER_CRITICAL(&mux);
+    if (!lock)
+        lock = xSemaphoreCreateMutexStatic(&lock_buf);
+    taskEXIT_CRITICAL(&mux);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!async_jobs) {
+        async_idle = xSemaphoreCreateCounting(HTTPD_ASYNC_WORKERS, 0);
+        async_jobs = async_idle ? xQueueCreate(HTTPD_ASYNC_WORKERS, sizeof(httpd_async_job_t)) : NULL;
+        if (!async_jobs) {
+            if (async_idle)
+                vSemaphoreDelete(async_idle);
+            async_idle = NULL;
+            rc = ESP_ERR_NO_MEM;
+        }
+        for (int i = 0; rc == ESP_OK && i < HTTPD_ASYNC_WORKERS; i++) {
+            if (xTaskCreate(httpd_async_worker, "httpd_async", CONFIG_HTTPD_ASYNC_WORKER_STACK_SIZE, NULL,
+                            CONFIG_HTTPD_ASYNC_WORKER_PRIORITY, &async_workers[i]) != pdPASS) {
+                ESP_LOGE(TAG, "async worker %d not started", i);
+                break;
+            }
+            xSemaphoreGive(async_idle);
+        }
+    }
+    xSemaphoreGive(lock);
+    return rc;
+}
+
+static bool httpd_async_in_worker(void)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+    for (int i = 0; i < HTTPD_ASYNC_WORKERS; i++) {
+        if (async_workers[i] == task)
+            return true;
+    }
+    return false;
+}
+
+esp_err_t esp_httpd_async_detach(httpd_req_t *req, esp_err_t (*handler)(httpd_req_t *req))
+{
+    httpd_async_job_t job = { .handler = handler };
+    esp_err_t rc;
+
+    CHECK_ARG(req && handler);
+
+    if (httpd_async_in_worker())
+        return ESP_ERR_INVALID_STATE;
+
+    rc = httpd_async_init();
+    if (rc != ESP_OK)
+        return rc;
+
+    if (xSemaphoreTake(async_idle, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "async workers busy, %s handled in place", req->uri);
+        return ESP_ERR_NO_MEM;
+    }
+
+    rc = httpd_req_async_handler_begin(req, &job.req);
+    if (rc != ESP_OK) {
+        xSemaphoreGive(async_idle);
+        return rc;
+    }
+    //idle worker is waiting, queue has room
+    xQueueSend(async_jobs, &job, portMAX_DELAY);
     return ESP_OK;
 }
+#else
+esp_err_t esp_httpd_async_detach(httpd_req_t *req, esp_err_t (*handler)(httpd_req_t *req))
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
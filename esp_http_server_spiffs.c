@@ -9,12 +9,19 @@
 #include <esp_spiffs.h>
 #include <esp_partition.h>
 #include <esp_log.h>
+#include <esp_idf_version.h>
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include <esp_random.h>
+#endif
 #include <dirent.h>
 #include <unistd.h>
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <inttypes.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include "include/esp_http_server_spiffs.h"
 #include "include/esp_http_server_misc.h"
@@ -22,22 +29,207 @@
 
 static const char *TAG = "SPIFFS";
 
-static cJSON *spiffs_file_list_to_json(const char *path)
+//bumped by every change made through these handlers, starts random on boot
+static volatile uint32_t spiffs_version;
+
+typedef struct {
+    const esp_partition_t *part;
+    size_t offset;
+#ifdef CONFIG_HTTPD_UPLOAD_INCREMENTAL_ERASE
+    esp_http_upload_erase_t erase;
+#endif
+#ifdef CONFIG_HTTPD_SPIFFS_IMAGE_DIFF
+    uint8_t *sector; //flash sector read buffer
+#endif
+    esp_http_upload_coalesce_t blocks;
+    esp_http_upload_stats_t stats;
+} spiffs_image_writer_t;
+
+static esp_err_t spiffs_file_write(void *ctx, const char *data, size_t len)
+{
+    FILE *f = ctx;
+    size_t wr = fwrite((const void *)data, len, 1, f);
+    if (wr != 1) {
+        ESP_LOGE(TAG, "spiffs write error: err=0x%x", wr);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static const esp_http_upload_stage_ops_t spiffs_file_ops = {
+    .write = spiffs_file_write,
+};
+
+#ifdef CONFIG_HTTPD_SPIFFS_IMAGE_DIFF
+/* Compare image sector with flash content, space behind image end is
+compared as erased. Sector is erased only if some bits have to be set */
+static esp_err_t spiffs_image_write_sector(spiffs_image_writer_t *wr, const uint8_t *data, size_t len)
+{
+    const uint8_t *old = wr->sector;
+    bool same = true;
+    bool need_erase = false;
+    esp_err_t rc;
+
+    rc = esp_partition_read(wr->part, wr->offset, wr->sector, SPI_FLASH_SEC_SIZE);
+    if (rc != ESP_OK)
+        return rc;
+
+    for (size_t i = 0; i < SPI_FLASH_SEC_SIZE; i++) {
+        uint8_t val = (i < len) ? data[i] : 0xFF;
+        if (old[i] != val) {
+            same = false;
+            if ((old[i] & val) != val || wr->part->encrypted) {
+                need_erase = true;
+                break;
+            }
+        }
+    }
+
+    if (same) {
+        wr->stats.sectors_skipped++;
+    } else {
+        if (need_erase) {
+            rc = esp_partition_erase_range(wr->part, wr->offset, SPI_FLASH_SEC_SIZE);
+            if (rc != ESP_OK)
+                return rc;
+        }
+        if (len > 0) {
+            rc = esp_partition_write(wr->part, wr->offset, data, len);
+            if (rc != ESP_OK)
+                return rc;
+        }
+        wr->stats.sectors_written++;
+    }
+    wr->erase.erased = wr->offset + SPI_FLASH_SEC_SIZE;
+    return ESP_OK;
+}
+#endif
+
+static esp_err_t spiffs_image_write(void *ctx, const char *data, size_t len)
+{
+    spiffs_image_writer_t *wr = ctx;
+    esp_err_t rc;
+
+    if (wr->offset + len > wr->part->size) {
+        ESP_LOGE(TAG, "image file too big");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+#ifdef CONFIG_HTTPD_SPIFFS_IMAGE_DIFF
+    //blocks are sector aligned, only last one may be shorter
+    while (len > 0) {
+        size_t n = MIN(len, SPI_FLASH_SEC_SIZE);
+        rc = spiffs_image_write_sector(wr, (const uint8_t *)data, n);
+        if (rc != ESP_OK) {
+            ESP_LOGE(TAG, "image write error: err=0x%x", rc);
+            return rc;
+        }
+        wr->offset += n;
+        data += n;
+        len -= n;
+    }
+    return ESP_OK;
+#else
+#ifdef CONFIG_HTTPD_UPLOAD_INCREMENTAL_ERASE
+    rc = esp_http_upload_erase_range(&wr->erase, wr->offset, len);
+    if (rc != ESP_OK) {
+        ESP_LOGE(TAG, "partition erase failed: err=0x%x", rc);
+        return rc;
+    }
+#endif
+
+    rc = esp_partition_write(wr->part, wr->offset, (const void *)data, len);
+    if (rc != ESP_OK) {
+        ESP_LOGE(TAG, "image write error: err=0x%x", rc);
+        return rc;
+    }
+    wr->offset += len;
+    return ESP_OK;
+#endif
+}
+
+static esp_err_t spiffs_image_data(void *ctx, const char *data, size_t len)
+{
+    spiffs_image_writer_t *wr = ctx;
+    return esp_http_upload_coalesce_write(&wr->blocks, data, len);
+}
+
+//sparse image fill, erased and don't care areas are only erased
+static esp_err_t spiffs_image_fill(void *ctx, const uint32_t *value, size_t len)
+{
+    spiffs_image_writer_t *wr = ctx;
+    esp_err_t rc;
+
+    if (value && *value != UINT32_MAX) {
+        uint32_t pattern[16];
+        for (int i = 0; i < sizeof(pattern) / sizeof(pattern[0]); i++)
+            pattern[i] = *value;
+
+        while (len > 0) {
+            size_t n = MIN(len, sizeof(pattern));
+            rc = esp_http_upload_coalesce_write(&wr->blocks, (const char *)pattern, n);
+            if (rc != ESP_OK)
+                return rc;
+            len -= n;
+        }
+        return ESP_OK;
+    }
+
+    //sparse blocks are sector aligned, so is pending data
+    rc = esp_http_upload_coalesce_flush(&wr->blocks);
+    if (rc != ESP_OK)
+        return rc;
+
+    if (wr->offset + len > wr->part->size) {
+        ESP_LOGE(TAG, "image file too big");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    //don't care area must not keep old file system pages, it is erased like 0xff fill
+#if defined(CONFIG_HTTPD_SPIFFS_IMAGE_DIFF)
+    for (size_t end = wr->offset + len; wr->offset < end; wr->offset += SPI_FLASH_SEC_SIZE) {
+        rc = spiffs_image_write_sector(wr, NULL, 0);
+        if (rc != ESP_OK)
+            return rc;
+    }
+    return ESP_OK;
+#elif defined(CONFIG_HTTPD_UPLOAD_INCREMENTAL_ERASE)
+    rc = esp_http_upload_erase_range(&wr->erase, wr->offset, len);
+    if (rc != ESP_OK)
+        return rc;
+#endif
+    wr->offset += len;
+    return ESP_OK;
+}
+
+static void spiffs_changed(void)
+{
+    spiffs_version++;
+}
+
+static void spiffs_file_list_to_json(esp_httpd_json_t *jw, const char *key, const char *path)
 {
     struct dirent *de;
     DIR *dir = opendir(path);
     if (!dir)
-        return NULL;
+        return;
 
-    cJSON *js_array = cJSON_CreateArray();
+    esp_httpd_json_array(jw, key);
     while (true) {
         de = readdir(dir);
         if (!de)
             break;
-        cJSON_AddItemToArray(js_array, cJSON_CreateString(de->d_name));
+        esp_httpd_json_string(jw, NULL, de->d_name);
     }
+    esp_httpd_json_close(jw);
     closedir(dir);
-    return js_array;
+}
+
+static void spiffs_usage_to_json(esp_httpd_json_t *jw, size_t total, size_t used)
+{
+    esp_httpd_json_int(jw, "used", used);
+    esp_httpd_json_int(jw, "total", total);
+    esp_httpd_json_int(jw, "percent", total ? 100 * used / total : 0);
 }
 
 esp_err_t esp_httpd_spiffs_info_handler(httpd_req_t *req)
@@ -64,27 +256,185 @@ esp_err_t esp_httpd_spiffs_info_handler(httpd_req_t *req)
             if (httpd_query_key_value(buf, "remove", param, sizeof(param)) == ESP_OK) {
                 ESP_LOGI(TAG, "remove %s", param);
                 rc = unlink(param);
+                spiffs_changed();
             }
         }
         free(buf);
     }
 
-    cJSON *js = cJSON_CreateObject();
+    esp_httpd_json_t jw;
+    char etag[HTTPD_ETAG_LEN];
+    char tag[24];
     esp_spiffs_info(esp_vfs_spiffs_conf->partition_label, &total, &used);
-    cJSON_AddStringToObject(js, "result", esp_err_to_name(rc));
-    cJSON_AddNumberToObject(js, "used", used);
-    cJSON_AddNumberToObject(js, "total", total);
-    cJSON_AddNumberToObject(js, "percent", 100 * used / total);
-    cJSON_AddItemToObject(js, "files", spiffs_file_list_to_json(esp_vfs_spiffs_conf->base_path));
 
-    return esp_httpd_resp_json(req, js);
+    //used bytes catch most changes made by application itself
+    if (!spiffs_version)
+        spiffs_version = esp_random();
+    sprintf(tag, "%08" PRIx32 "-%x", spiffs_version, used);
+    if (buf_len == 1 && esp_httpd_resp_not_modified(req, etag, tag))
+        return ESP_OK;
+
+    esp_httpd_json_begin(&jw, req);
+    esp_httpd_json_string(&jw, "result", esp_err_to_name(rc));
+    spiffs_usage_to_json(&jw, total, used);
+    spiffs_file_list_to_json(&jw, "files", esp_vfs_spiffs_conf->base_path);
+    return esp_httpd_json_end(&jw);
 }
 
-esp_err_t esp_httpd_spiffs_file_upload_handler(httpd_req_t *req)
+void esp_httpd_spiffs_info_section(esp_httpd_json_t *jw, const esp_httpd_batch_t *sel, void *arg)
+{
+    const esp_vfs_spiffs_conf_t *conf = arg;
+    size_t total = 0, used = 0;
+
+    if (!conf)
+        return;
+    esp_spiffs_info(conf->partition_label, &total, &used);
+    spiffs_usage_to_json(jw, total, used);
+    //directory listing is the costly part, only on request
+    if (esp_httpd_batch_field(sel, "files", false))
+        spiffs_file_list_to_json(jw, "files", conf->base_path);
+}
+
+//upload path ending with '/' takes every file part of request
+static bool spiffs_upload_is_dir(const char *path)
 {
-    char boundary[BOUNDARY_LEN] = { 0 };
-    size_t bytes_left = req->content_len;
-    int32_t bytes_read = 0;
+    size_t len = strlen(path);
+    return len > 0 && path[len - 1] == '/';
+}
+
+/* Build SPIFFS path of uploaded file from part filename. Leading slashes
+ * are dropped, empty, "." and ".." path components, backslashes and
+ * control characters are refused, so file cannot land outside directory.
+ */
+static esp_err_t spiffs_upload_path(char *path, size_t size, const char *dir, const char *filename)
+{
+    const char *name = filename;
+    const char *c;
+
+    while (*name == '/')
+        name++;
+    if (!*name || name[strlen(name) - 1] == '/')
+        return ESP_ERR_INVALID_ARG;
+
+    for (c = name; *c; c++) {
+        if (*c == '\\' || (unsigned char)*c < ' ')
+            return ESP_ERR_INVALID_ARG;
+        if (c == name || c[-1] == '/') {
+            size_t comp = strcspn(c, "/");
+            if (comp == 0 || (comp == 1 && c[0] == '.') || (comp == 2 && c[0] == '.' && c[1] == '.'))
+                return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    if (snprintf(path, size, "%s%s", dir, name) >= size)
+        return ESP_ERR_INVALID_SIZE;
+    return ESP_OK;
+}
+
+//pass current file part through pipeline into file, partially written file is removed
+static esp_err_t spiffs_upload_part(esp_http_upload_pipeline_t *pl, const char *path)
+{
+    esp_http_upload_coalesce_t blocks = { 0 };
+    esp_err_t rc;
+
+    ESP_LOGI(TAG, "opening file %s", path);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Failed to open file %s for writing", path);
+        return ESP_FAIL;
+    }
+    //data is written in page aligned blocks, skip stdio buffer
+    setvbuf(f, NULL, _IONBF, 0);
+
+    rc = esp_http_upload_pipeline_add(pl, &spiffs_file_ops, f);
+    if (rc == ESP_OK)
+        rc = esp_http_upload_coalesce_init(&blocks, UPLOAD_BUF_LEN, UPLOAD_PIPELINE_WRITE(pl), UPLOAD_PIPELINE_CTX(pl));
+    if (rc == ESP_OK)
+        rc = esp_http_upload_pipeline_add(pl, &esp_http_upload_coalesce_ops, &blocks);
+    if (rc == ESP_OK)
+        rc = esp_http_upload_pipeline_run_part(pl);
+    else
+        esp_http_upload_coalesce_free(&blocks);
+    fclose(f);
+
+    if (rc != ESP_OK)
+        unlink(path);
+    return rc;
+}
+
+//every file part of request goes to dir/filename, response lists result of each file
+static esp_err_t spiffs_upload_dir(httpd_req_t *req, const char *dir)
+{
+    esp_http_upload_pipeline_t pl;
+    esp_http_upload_stats_t stats = { 0 };
+    esp_httpd_json_t jw;
+    char path[128];
+    int files = 0;
+    esp_err_t rc, result = ESP_OK;
+
+    rc = esp_http_upload_pipeline_begin(&pl, req, &stats);
+    if (rc != ESP_OK)
+        return esp_http_upload_json_status(req, rc, 0);
+
+    //file results are streamed as parts complete, writer buffers them until it fills up
+    TickType_t start = xTaskGetTickCount();
+    esp_httpd_json_begin(&jw, req);
+    esp_httpd_json_array(&jw, "files");
+    for (; rc == ESP_OK && !pl.dropped; rc = esp_http_upload_pipeline_next(&pl)) {
+        if (!pl.mp.part.filename[0])
+            continue; //plain form field
+
+        size_t before = stats.bytes_uploaded;
+        esp_err_t part_rc = spiffs_upload_path(path, sizeof(path), dir, pl.mp.part.filename);
+        if (part_rc == ESP_OK)
+            part_rc = spiffs_upload_part(&pl, path);
+        else
+            ESP_LOGE(TAG, "bad file name %s", pl.mp.part.filename);
+        size_t written = stats.bytes_uploaded - before;
+        ESP_LOGI(TAG, "%s: %u bytes, %s", pl.mp.part.filename, written, esp_err_to_name(part_rc));
+
+        char written_str[32];
+        sprintf(written_str, "%u", written);
+        esp_httpd_json_object(&jw, NULL);
+        esp_httpd_json_string(&jw, "name", pl.mp.part.filename);
+        esp_httpd_json_string(&jw, "result", esp_err_to_name(part_rc));
+        esp_httpd_json_string(&jw, "bytes_uploaded", written_str);
+        esp_httpd_json_close(&jw);
+
+        if (part_rc != ESP_OK && result == ESP_OK)
+            result = part_rc;
+        files++;
+    }
+    bool dropped = pl.dropped;
+    esp_http_upload_pipeline_end(&pl);
+    esp_httpd_json_close(&jw);
+
+    //final boundary or connection drop already reported by part
+    if (rc != ESP_ERR_NOT_FOUND && !dropped && result == ESP_OK)
+        result = rc == ESP_OK ? ESP_FAIL : rc;
+    if (result == ESP_OK && files == 0) {
+        ESP_LOGE(TAG, "no file uploaded");
+        result = ESP_ERR_NOT_FOUND;
+    }
+
+    size_t total = stats.bytes_uploaded;
+    uint32_t ms = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+    char buf[32];
+    sprintf(buf, "%u", total);
+
+    esp_httpd_json_string(&jw, "result", esp_err_to_name(result));
+    esp_httpd_json_string(&jw, "bytes_uploaded", buf);
+    esp_httpd_json_int(&jw, "time_ms", ms);
+    esp_httpd_json_int(&jw, "bytes_per_sec", ms ? (uint64_t)total * 1000 / ms : total);
+    ESP_LOGI(TAG, "%d files, %u bytes uploaded in %" PRIu32 " ms", files, total, ms);
+
+    return esp_httpd_json_end(&jw);
+}
+
+static esp_err_t spiffs_file_upload(httpd_req_t *req)
+{
+    esp_http_upload_pipeline_t pl;
+    esp_http_upload_stats_t stats = { 0 };
     esp_err_t rc;
 
     const char *upload_path = req->user_ctx;
@@ -92,99 +442,54 @@ esp_err_t esp_httpd_spiffs_file_upload_handler(httpd_req_t *req)
         ESP_LOGE(TAG, "upload path not found");
         return esp_http_upload_json_status(req, ESP_ERR_INVALID_ARG, 0);
     }
+    if (spiffs_upload_is_dir(upload_path))
+        return spiffs_upload_dir(req, upload_path);
 
-    rc = esp_http_get_boundary(req, boundary);
+    rc = esp_http_upload_pipeline_begin(&pl, req, &stats);
     if (rc != ESP_OK)
         return esp_http_upload_json_status(req, rc, 0);
 
-    //Read request data
-    bytes_read = esp_http_upload_check_initial_boundary(req, boundary, bytes_left);
-    if (bytes_read > 0)
-        bytes_left -= bytes_read;
-    else
-        return esp_http_upload_json_status(req, ESP_ERR_INVALID_ARG, 0);
+    rc = spiffs_upload_part(&pl, upload_path);
+    esp_http_upload_pipeline_end(&pl);
 
-    bytes_read = esp_http_upload_find_multipart_header_end(req, bytes_left);
-    if (bytes_read > 0)
-        bytes_left -= bytes_read;
-    else
-        return esp_http_upload_json_status(req, ESP_ERR_INVALID_ARG, 0);
-
-    ESP_LOGI(TAG, "opening file %s", upload_path);
-    FILE *f = fopen(upload_path, "w");
-    if (f == NULL) {
-        ESP_LOGE(TAG, "Failed to open file for writing");
-        return esp_http_upload_json_status(req, ESP_FAIL, 0);
-    }
+    if (rc != ESP_OK)
+        return esp_http_upload_json_status(req, ESP_FAIL, stats.bytes_uploaded);
 
-    //now we have content data until end boundary
-    ssize_t boundary_len = strlen(boundary);
-    ssize_t final_boundary_len = boundary_len + 2;                // additional "--"
-    uint32_t binary_size = bytes_left - (final_boundary_len + 4); //CRLF CRLF
-    uint32_t bytes_written = 0;
-    uint32_t to_read;
-    int32_t recv;
-    size_t wr;
-
-    if (binary_size == 0) {
-        fclose(f);
+    if (stats.bytes_uploaded == 0) {
         ESP_LOGE(TAG, "no file uploaded");
         return esp_http_upload_json_status(req, ESP_ERR_NOT_FOUND, 0);
     }
 
-    //prepare buffer, keep in mind to free it before return call
-    char *buf = (char *)malloc(UPLOAD_BUF_LEN);
-    if (!buf) {
-        fclose(f);
-        return esp_http_upload_json_status(req, ESP_ERR_NO_MEM, 0);
-    }
+    ESP_LOGI(TAG, "%u file bytes uploaded OK", stats.bytes_uploaded);
+    return esp_http_upload_json_status(req, ESP_OK, stats.bytes_uploaded);
+}
 
-    while (bytes_written < binary_size) {
-        if (bytes_left > UPLOAD_BUF_LEN)
-            to_read = MIN(bytes_left, UPLOAD_BUF_LEN);
-        else
-            to_read = bytes_left - (final_boundary_len + 4);
-
-        recv = httpd_req_recv(req, buf, to_read);
-        if (recv < 0) {
-            // Retry receiving if timeout occurred
-            if (recv == HTTPD_SOCK_ERR_TIMEOUT)
-                continue;
-            ESP_LOGE(TAG, "httpd_req_recv error: err=0x%" PRIx32, recv);
-            free(buf);
-            fclose(f);
-            return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
-        }
-        bytes_left -= recv;
-
-        wr = fwrite((const void *)buf, recv, 1, f);
-        if (wr != 1) {
-            ESP_LOGE(TAG, "spiffs write error: err=0x%x", wr);
-            free(buf);
-            fclose(f);
-            return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
-        }
-        bytes_written += recv;
-        ESP_LOGI(TAG, "file upload %" PRId32 "/%" PRId32 "bytes", bytes_written, binary_size);
-    }
-    free(buf);
-    fclose(f);
+esp_err_t esp_httpd_spiffs_file_upload_handler(httpd_req_t *req)
+{
+    esp_http_upload_ticket_t ticket = {
+        .heap = 2 * UPLOAD_BUF_LEN, //receive buffer and write block
+    };
+    esp_err_t rc;
 
-    bytes_read = esp_http_upload_check_final_boundary(req, boundary, bytes_left);
-    if (bytes_read > 0)
-        bytes_left -= bytes_read;
-    else
-        return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
+    if (esp_httpd_async_detach(req, esp_httpd_spiffs_file_upload_handler) == ESP_OK)
+        return ESP_OK;
+
+    rc = esp_http_upload_admit(req, &ticket);
+    if (rc != ESP_OK)
+        return esp_http_upload_busy(req, rc);
 
-    ESP_LOGI(TAG, "%" PRIu32 " file bytes uploaded OK", bytes_written);
-    return esp_http_upload_json_status(req, ESP_OK, bytes_written);
+    rc = spiffs_file_upload(req);
+    spiffs_changed();
+    esp_http_upload_release(&ticket);
+    return rc;
 }
 
-esp_err_t esp_httpd_spiffs_image_upload_handler(httpd_req_t *req)
+static esp_err_t spiffs_image_upload(httpd_req_t *req)
 {
-    char boundary[BOUNDARY_LEN] = { 0 };
-    size_t bytes_left = req->content_len;
-    int32_t bytes_read = 0;
+    esp_http_upload_pipeline_t pl;
+    esp_http_upload_sparse_t sparse;
+    uint8_t installed[UPLOAD_DIGEST_LEN];
+    spiffs_image_writer_t writer;
     esp_err_t rc;
 
     const esp_vfs_spiffs_conf_t *esp_vfs_spiffs_conf = req->user_ctx;
@@ -212,97 +517,116 @@ esp_err_t esp_httpd_spiffs_image_upload_handler(httpd_req_t *req)
         return esp_http_upload_json_status(req, ESP_FAIL, 0);
     }
 
-    rc = esp_http_get_boundary(req, boundary);
+    //same image already in partition, skip transfer and erase
+    if (esp_http_upload_match_partition(req, spiffs_part, installed) == ESP_OK)
+        return esp_http_upload_not_modified(req, installed);
+
+    memset(&writer.stats, 0, sizeof(writer.stats));
+    rc = esp_http_upload_pipeline_begin(&pl, req, &writer.stats);
     if (rc != ESP_OK)
         return esp_http_upload_json_status(req, rc, 0);
 
-    //Read request data
-    bytes_read = esp_http_upload_check_initial_boundary(req, boundary, bytes_left);
-    if (bytes_read > 0)
-        bytes_left -= bytes_read;
-    else
-        return esp_http_upload_json_status(req, ESP_ERR_INVALID_ARG, 0);
-
-    bytes_read = esp_http_upload_find_multipart_header_end(req, bytes_left);
-    if (bytes_read > 0)
-        bytes_left -= bytes_read;
-    else
-        return esp_http_upload_json_status(req, ESP_ERR_INVALID_ARG, 0);
-
-    //now we have content data until end boundary
-    size_t boundary_len = strlen(boundary);
-    size_t final_boundary_len = boundary_len + 2;               // additional "--"
-    size_t binary_size = bytes_left - (final_boundary_len + 4); //CRLF CRLF
-    size_t bytes_written = 0;
-    size_t to_read;
-    int32_t recv;
-
-    if (binary_size == 0) {
-        ESP_LOGE(TAG, "no file uploaded");
-        return esp_http_upload_json_status(req, ESP_ERR_NOT_FOUND, 0);
-    }
-
-    if (binary_size > spiffs_part->size) {
-        ESP_LOGE(TAG, "image file too big");
-        return esp_http_upload_json_status(req, ESP_ERR_INVALID_SIZE, 0);
-    }
-
-    ESP_LOGI(TAG, "\"%s\" partition found, formating...", label);
-
     if (esp_spiffs_mounted(label))
         esp_vfs_spiffs_unregister(label);
 
+#ifndef CONFIG_HTTPD_UPLOAD_INCREMENTAL_ERASE
+    ESP_LOGI(TAG, "\"%s\" partition found, formating...", label);
     rc = esp_partition_erase_range(spiffs_part, 0, spiffs_part->size);
     if (rc != ESP_OK) {
         ESP_LOGE(TAG, "partition erase failed: err=0x%x", rc);
+        esp_http_upload_pipeline_end(&pl);
         return esp_http_upload_json_status(req, ESP_FAIL, 0);
     }
-
-    //prepare buffer, keep in mind to free it before return call
-    char *buf = (char *)malloc(UPLOAD_BUF_LEN);
-    if (!buf)
+#else
+    esp_http_upload_erase_init(&writer.erase, spiffs_part);
+#endif
+
+    writer.part = spiffs_part;
+    writer.offset = 0;
+#ifdef CONFIG_HTTPD_SPIFFS_IMAGE_DIFF
+    writer.sector = malloc(SPI_FLASH_SEC_SIZE);
+    if (!writer.sector) {
+        esp_http_upload_pipeline_end(&pl);
         return esp_http_upload_json_status(req, ESP_ERR_NO_MEM, 0);
+    }
+#endif
 
-    while (bytes_written < binary_size) {
-        if (bytes_left > UPLOAD_BUF_LEN)
-            to_read = MIN(bytes_left, UPLOAD_BUF_LEN);
-        else
-            to_read = bytes_left - (final_boundary_len + 4);
-
-        recv = httpd_req_recv(req, buf, to_read);
-        if (recv < 0) {
-            // Retry receiving if timeout occurred
-            if (recv == HTTPD_SOCK_ERR_TIMEOUT)
-                continue;
-            ESP_LOGE(TAG, "httpd_req_recv error: err=0x%" PRIx32, recv);
-            free(buf);
-            return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
-        }
-        bytes_left -= recv;
-
-        rc = esp_partition_write(spiffs_part, bytes_written, (const void *)buf, recv);
-        if (rc != ESP_OK) {
-            ESP_LOGE(TAG, "image write error: err=0x%x", rc);
-            free(buf);
-            return esp_http_upload_json_status(req, rc, bytes_written);
-        }
-        bytes_written += recv;
-        ESP_LOGI(TAG, "image upload %d/%d bytes", bytes_written, binary_size);
+    //sector aligned blocks
+    size_t block_size = MAX(SPI_FLASH_SEC_SIZE, UPLOAD_BUF_LEN - UPLOAD_BUF_LEN % SPI_FLASH_SEC_SIZE);
+    rc = esp_http_upload_coalesce_init(&writer.blocks, block_size, spiffs_image_write, &writer);
+    if (rc == ESP_OK)
+        rc = esp_http_upload_pipeline_add(&pl, &esp_http_upload_coalesce_ops, &writer.blocks);
+    if (rc != ESP_OK) {
+#ifdef CONFIG_HTTPD_SPIFFS_IMAGE_DIFF
+        free(writer.sector);
+#endif
+        esp_http_upload_pipeline_end(&pl);
+        return esp_http_upload_json_status(req, rc, 0);
     }
-    free(buf);
 
-    bytes_read = esp_http_upload_check_final_boundary(req, boundary, bytes_left);
-    if (bytes_read > 0)
-        bytes_left -= bytes_read;
-    else
-        return esp_http_upload_json_status(req, ESP_FAIL, bytes_written);
+    //raw or sparse image, image which is not the one client sent is not mounted
+    esp_http_upload_sparse_init(&sparse, SPI_FLASH_SEC_SIZE, spiffs_image_data, spiffs_image_fill, &writer);
+    esp_http_upload_pipeline_add(&pl, &esp_http_upload_sparse_ops, &sparse);
+    rc = esp_http_upload_pipeline_run(&pl);
+#ifdef CONFIG_HTTPD_SPIFFS_IMAGE_DIFF
+    free(writer.sector);
+#endif
+
+#ifdef CONFIG_HTTPD_UPLOAD_INCREMENTAL_ERASE
+    //old filesystem data behind image must not be left
+    if (rc == ESP_OK)
+        rc = esp_http_upload_erase_range(&writer.erase, writer.offset, spiffs_part->size - writer.offset);
+#endif
+
+    if (rc != ESP_OK)
+        return esp_http_upload_json_stats(req, rc, &writer.stats);
+
+    if (writer.stats.bytes_uploaded == 0) {
+        ESP_LOGE(TAG, "no file uploaded");
+        return esp_http_upload_json_status(req, ESP_ERR_NOT_FOUND, 0);
+    }
 
-    ESP_LOGI(TAG, "image upload complete %d bytes uploaded OK", bytes_written);
+    ESP_LOGI(TAG, "image upload complete %d bytes uploaded OK, image size %d", writer.stats.bytes_uploaded,
+             sparse.image_size);
+#ifdef CONFIG_HTTPD_SPIFFS_IMAGE_DIFF
+    ESP_LOGI(TAG, "%u sectors written, %u skipped", writer.stats.sectors_written, writer.stats.sectors_skipped);
+#endif
     rc = esp_vfs_spiffs_register(esp_vfs_spiffs_conf);
     if (rc != ESP_OK) {
         ESP_LOGE(TAG, "esp_vfs_spiffs_register error: err=0x%x", rc);
-        return esp_http_upload_json_status(req, rc, bytes_written);
+        return esp_http_upload_json_stats(req, rc, &writer.stats);
     }
     ESP_LOGI(TAG, "esp_vfs_spiffs registered OK");
-    return esp_http_upload_json_status(req, ESP_OK, bytes_written);
+    return esp_http_upload_json_stats(req, ESP_OK, &writer.stats);
+}
+
+//image upload unmounts filesystem, refused while partition or its files are written
+esp_err_t esp_httpd_spiffs_image_upload_handler(httpd_req_t *req)
+{
+    const esp_vfs_spiffs_conf_t *conf = req->user_ctx;
+    esp_http_upload_ticket_t ticket = {
+        .heap = UPLOAD_BUF_LEN + MAX(SPI_FLASH_SEC_SIZE, UPLOAD_BUF_LEN),
+    };
+    esp_err_t rc;
+
+    if (esp_httpd_async_detach(req, esp_httpd_spiffs_image_upload_handler) == ESP_OK)
+        return ESP_OK;
+
+    if (conf && conf->partition_label)
+        ticket.part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS,
+                                               conf->partition_label);
+    if (!ticket.part)
+        return spiffs_image_upload(req); //reports configuration error
+#ifdef CONFIG_HTTPD_SPIFFS_IMAGE_DIFF
+    ticket.heap += SPI_FLASH_SEC_SIZE;
+#endif
+
+    rc = esp_http_upload_admit(req, &ticket);
+    if (rc != ESP_OK)
+        return esp_http_upload_busy(req, rc);
+
+    rc = spiffs_image_upload(req);
+    spiffs_changed();
+    esp_http_upload_release(&ticket);
+    return rc;
 }
@@ -10,7 +10,11 @@
 #include <esp_log.h>
 #include <esp_wifi.h>
 #include <esp_netif.h>
+#include <esp_event.h>
 #include <sys/param.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
 
 /* For esp-idf backward compatibility */
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(6, 0, 0)
@@ -35,121 +39,135 @@
 
 static const char *TAG = "WiFi";
 
-static cJSON *ap_record_to_json(wifi_ap_record_t *ap_info)
+static void ap_record_to_json(esp_httpd_json_t *jw, const char *key, wifi_ap_record_t *ap_info)
 {
     char mac_buf[24];
-    cJSON *js = cJSON_CreateObject();
     sprintf(mac_buf, MACSTR, MAC2STR(ap_info->bssid));
 
-    cJSON_AddStringToObject(js, "bssid", mac_buf);
-    cJSON_AddStringToObject(js, "ssid", (const char *)ap_info->ssid);
-    cJSON_AddNumberToObject(js, "rssi", (const double)ap_info->rssi);
-    cJSON_AddNumberToObject(js, "ch", ap_info->primary);
-    cJSON_AddStringToObject(js, "authmode",
-                            ap_info->authmode == WIFI_AUTH_OPEN            ? "OPEN" :
-                            ap_info->authmode == WIFI_AUTH_WEP             ? "WEP" :
-                            ap_info->authmode == WIFI_AUTH_WPA_PSK         ? "WPA_PSK" :
-                            ap_info->authmode == WIFI_AUTH_WPA2_PSK        ? "WPA2_PSK" :
-                            ap_info->authmode == WIFI_AUTH_WPA_WPA2_PSK    ? "WPA_WPA2_PSK" :
-                            ap_info->authmode == WIFI_AUTH_WPA2_ENTERPRISE ? "WPA2_ENTERPRISE" :
-                                                                             "??");
-    return js;
+    esp_httpd_json_object(jw, key);
+    esp_httpd_json_string(jw, "bssid", mac_buf);
+    esp_httpd_json_string(jw, "ssid", (const char *)ap_info->ssid);
+    esp_httpd_json_int(jw, "rssi", ap_info->rssi);
+    esp_httpd_json_int(jw, "ch", ap_info->primary);
+    esp_httpd_json_string(jw, "authmode",
+                          ap_info->authmode == WIFI_AUTH_OPEN            ? "OPEN" :
+                          ap_info->authmode == WIFI_AUTH_WEP             ? "WEP" :
+                          ap_info->authmode == WIFI_AUTH_WPA_PSK         ? "WPA_PSK" :
+                          ap_info->authmode == WIFI_AUTH_WPA2_PSK        ? "WPA2_PSK" :
+                          ap_info->authmode == WIFI_AUTH_WPA_WPA2_PSK    ? "WPA_WPA2_PSK" :
+                          ap_info->authmode == WIFI_AUTH_WPA2_ENTERPRISE ? "WPA2_ENTERPRISE" :
+                                                                           "??");
+    esp_httpd_json_close(jw);
 }
 
-static cJSON *ip_info_to_json(esp_ip_info_t *ip_info)
+static void ip_info_to_json(esp_httpd_json_t *jw, esp_ip_info_t *ip_info)
 {
     char buf[16];
-    cJSON *js = cJSON_CreateObject();
 
+    esp_httpd_json_object(jw, "ip_info");
     sprintf(buf, IPSTR, IP2STR(&ip_info->ip));
-    cJSON_AddStringToObject(js, "ip", buf);
+    esp_httpd_json_string(jw, "ip", buf);
 
     sprintf(buf, IPSTR, IP2STR(&ip_info->netmask));
-    cJSON_AddStringToObject(js, "netmask", buf);
+    esp_httpd_json_string(jw, "netmask", buf);
 
     sprintf(buf, IPSTR, IP2STR(&ip_info->gw));
-    cJSON_AddStringToObject(js, "gw", buf);
-    return js;
+    esp_httpd_json_string(jw, "gw", buf);
+    esp_httpd_json_close(jw);
 }
 
 /* get wifi access point interface info */
-static cJSON *get_wifi_ap_info(void)
+static void get_wifi_ap_info(esp_httpd_json_t *jw)
 {
     esp_ip_info_t ip_info = { 0 };
-    cJSON *js = cJSON_CreateObject();
 
+    esp_httpd_json_object(jw, "ap");
 #if CONFIG_IDF_TARGET_ESP8266
     if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_AP, &ip_info) == ESP_OK)
-        cJSON_AddItemToObject(js, "ip_info", ip_info_to_json(&ip_info));
+        ip_info_to_json(jw, &ip_info);
 
 #else //ESP32xx
     esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
 
     if (esp_netif_get_ip_info(netif, &ip_info) == ESP_OK)
-        cJSON_AddItemToObject(js, "ip_info", ip_info_to_json(&ip_info));
+        ip_info_to_json(jw, &ip_info);
 #endif
-    return js;
+    esp_httpd_json_close(jw);
 }
 
 /* get wifi station interface info */
-static cJSON *get_wifi_sta_info(void)
+static void get_wifi_sta_info(esp_httpd_json_t *jw)
 {
     esp_ip_info_t ip_info = { 0 };
     wifi_ap_record_t ap_info = { 0 };
     esp_err_t rc;
 
-    cJSON *js = cJSON_CreateObject();
-
+    esp_httpd_json_object(jw, "sta");
 #if CONFIG_IDF_TARGET_ESP8266
     if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &ip_info) == ESP_OK)
-        cJSON_AddItemToObject(js, "ip_info", ip_info_to_json(&ip_info));
+        ip_info_to_json(jw, &ip_info);
 #else //ESP32xx
     esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
     if (esp_netif_get_ip_info(netif, &ip_info) == ESP_OK)
-        cJSON_AddItemToObject(js, "ip_info", ip_info_to_json(&ip_info));
+        ip_info_to_json(jw, &ip_info);
 #endif
 
     rc = esp_wifi_sta_get_ap_info(&ap_info);
     if (rc == ESP_OK)
-        cJSON_AddItemToObject(js, "connection", ap_record_to_json(&ap_info));
-
-    cJSON_AddStringToObject(js, "status",
-                            (rc == ESP_OK && ip_info.ip.addr)  ? "connected" :
-                            (rc == ESP_OK && !ip_info.ip.addr) ? "connecting" :
-                            (rc == ESP_ERR_WIFI_CONN)          ? "not initialized" :
-                            (rc == ESP_ERR_WIFI_NOT_CONNECT)   ? "disconnected" :
-                                                                 "??");
-    return js;
+        ap_record_to_json(jw, "connection", &ap_info);
+
+    esp_httpd_json_string(jw, "status",
+                          (rc == ESP_OK && ip_info.ip.addr)  ? "connected" :
+                          (rc == ESP_OK && !ip_info.ip.addr) ? "connecting" :
+                          (rc == ESP_ERR_WIFI_CONN)          ? "not initialized" :
+                          (rc == ESP_ERR_WIFI_NOT_CONNECT)   ? "disconnected" :
+                                                               "??");
+    esp_httpd_json_close(jw);
 }
 
-static cJSON *wifi_info_to_json(void)
+void esp_httpd_wifi_info_section(esp_httpd_json_t *jw, const esp_httpd_batch_t *sel, void *arg)
 {
-    cJSON *js = cJSON_CreateObject();
-    cJSON_AddItemToObject(js, "ap", get_wifi_ap_info());
-    cJSON_AddItemToObject(js, "sta", get_wifi_sta_info());
-    return js;
+    if (esp_httpd_batch_field(sel, "ap", true))
+        get_wifi_ap_info(jw);
+    if (esp_httpd_batch_field(sel, "sta", true))
+        get_wifi_sta_info(jw);
 }
 
-static cJSON *wifi_config_to_json(void)
+void esp_httpd_wifi_config_section(esp_httpd_json_t *jw, const esp_httpd_batch_t *sel, void *arg)
 {
-    wifi_config_t wifi_config_ap = { 0 };
-    wifi_config_t wifi_config_sta = { 0 };
+    if (esp_httpd_batch_field(sel, "ap", true)) {
+        wifi_config_t wifi_config = { 0 };
+        esp_wifi_get_config(ESP_IF_WIFI_AP, &wifi_config);
+        esp_httpd_json_object(jw, "ap");
+        esp_httpd_json_string(jw, "ssid", (const char *)wifi_config.ap.ssid);
+        esp_httpd_json_close(jw);
+    }
 
-    cJSON *js_ap = cJSON_CreateObject();
-    esp_wifi_get_config(ESP_IF_WIFI_AP, &wifi_config_ap);
-    cJSON_AddStringToObject(js_ap, "ssid", (const char *)wifi_config_ap.ap.ssid);
+    if (esp_httpd_batch_field(sel, "sta", true)) {
+        //own zeroed config, ap.ssid and sta.ssid share the union
+        wifi_config_t wifi_config = { 0 };
+        esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config);
+        esp_httpd_json_object(jw, "sta");
+        esp_httpd_json_string(jw, "ssid", (const char *)wifi_config.sta.ssid);
+        esp_httpd_json_close(jw);
+    }
+}
 
-    cJSON *js_sta = cJSON_CreateObject();
-    esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config_sta);
-    cJSON_AddStringToObject(js_sta, "ssid", (const char *)wifi_config_sta.sta.ssid);
+static void wifi_info_to_json(esp_httpd_json_t *jw, void *arg)
+{
+    esp_httpd_json_object(jw, "data");
+    esp_httpd_wifi_info_section(jw, NULL, NULL);
+    esp_httpd_json_close(jw);
+}
 
-    cJSON *js = cJSON_CreateObject();
-    cJSON_AddItemToObject(js, "ap", js_ap);
-    cJSON_AddItemToObject(js, "sta", js_sta);
-    return js;
+static void wifi_config_to_json(esp_httpd_json_t *jw, void *arg)
+{
+    esp_httpd_json_object(jw, "data");
+    esp_httpd_wifi_config_section(jw, NULL, NULL);
+    esp_httpd_json_close(jw);
 }
 
-static cJSON *wifi_scan_to_json(void)
+static void wifi_scan_to_json(esp_httpd_json_t *jw)
 {
     uint16_t ap_num = DEFAULT_SCAN_LIST_SIZE;
     wifi_ap_record_t ap_list[DEFAULT_SCAN_LIST_SIZE] = { 0 };
@@ -167,13 +185,13 @@ static cJSON *wifi_scan_to_json(void)
         ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_connect());
     }
 
-    cJSON *js = cJSON_CreateArray();
+    esp_httpd_json_array(jw, "data");
     ESP_LOGI(TAG, "APs scanned = %u", ap_num);
     for (int i = 0; (i < ap_num) && (i < DEFAULT_SCAN_LIST_SIZE); i++) {
         ESP_LOGI(TAG, "\tSSID: %s \tch=%d rssi=%d", ap_list[i].ssid, ap_list[i].primary, ap_list[i].rssi);
-        cJSON_AddItemToArray(js, ap_record_to_json(&ap_list[i]));
+        ap_record_to_json(jw, NULL, &ap_list[i]);
     }
-    return js;
+    esp_httpd_json_close(jw);
 }
 
 static esp_err_t wifi_handle_connect_req(httpd_req_t *req)
@@ -220,39 +238,266 @@ static esp_err_t wifi_handle_connect_req(httpd_req_t *req)
     return ESP_OK;
 }
 
+//scan blocks for seconds, other requests are served meanwhile
+static bool wifi_req_is_scan(httpd_req_t *req)
+{
+    char query[32];
+    char value[16];
+
+    return httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+           httpd_query_key_value(query, "action", value, sizeof(value)) == ESP_OK && !strcmp(value, "scan");
+}
+
 esp_err_t esp_httpd_wifi_handler(httpd_req_t *req)
 {
     CHECK_ARG(req);
 
-    cJSON *js;
+    if (wifi_req_is_scan(req) && esp_httpd_async_detach(req, esp_httpd_wifi_handler) == ESP_OK)
+        return ESP_OK;
+
+    esp_httpd_json_t jw;
     char *url_query;
     size_t qlen;
     char value[128];
 
-    js = cJSON_CreateObject();
-
     //parse URL query
     qlen = httpd_req_get_url_query_len(req) + 1;
     if (qlen > 1) {
         url_query = malloc(qlen);
-        if (httpd_req_get_url_query_str(req, url_query, qlen) == ESP_OK) {
-            if (httpd_query_key_value(url_query, "action", value, sizeof(value)) == ESP_OK) {
-                if (!strcmp(value, "get_config")) {
-                    cJSON_AddItemToObject(js, "data", wifi_config_to_json());
-                } else if (!strcmp(value, "scan")) {
-                    cJSON_AddItemToObject(js, "data", wifi_scan_to_json());
-                } else if (!strcmp(value, "connect")) {
-                    wifi_handle_connect_req(req);
-                    cJSON_AddItemToObject(js, "data", wifi_info_to_json());
-                } else if (!strcmp(value, "disconnect")) {
-                    esp_wifi_disconnect();
-                    cJSON_AddItemToObject(js, "data", wifi_info_to_json());
-                }
-            }
-        }
+        value[0] = '\0';
+        if (httpd_req_get_url_query_str(req, url_query, qlen) == ESP_OK)
+            httpd_query_key_value(url_query, "action", value, sizeof(value));
         free(url_query);
+
+        //connect request body is received before response starts
+        if (!strcmp(value, "connect"))
+            wifi_handle_connect_req(req);
+        else if (!strcmp(value, "disconnect"))
+            esp_wifi_disconnect();
+
+        if (!strcmp(value, "get_config"))
+            return esp_httpd_resp_json_etag(req, wifi_config_to_json, NULL);
+
+        esp_httpd_json_begin(&jw, req);
+        if (!strcmp(value, "scan"))
+            wifi_scan_to_json(&jw);
+        else if (!strcmp(value, "connect") || !strcmp(value, "disconnect"))
+            wifi_info_to_json(&jw, NULL);
+        return esp_httpd_json_end(&jw);
+    }
+
+    //polled state, unchanged most of the time
+    return esp_httpd_resp_json_etag(req, wifi_info_to_json, NULL);
+}
+
+#define WIFI_EVENTS_SECTIONS 2      //"ap" and "sta"
+#define WIFI_EVENTS_SECTION_LEN 384 //rendered state of one interface
+#define WIFI_EVENTS_RETRY "retry: 3000\n" //client reconnect delay, ms
+
+//subscribers and state they were sent last, touched only from HTTPD task
+typedef struct {
+    httpd_handle_t server;
+    int fds[CONFIG_HTTPD_WIFI_EVENTS_MAX_CLIENTS]; //-1 for free slot
+    char state[WIFI_EVENTS_SECTIONS][WIFI_EVENTS_SECTION_LEN];
+    size_t state_len[WIFI_EVENTS_SECTIONS];
+    char msg[64 + WIFI_EVENTS_SECTIONS * WIFI_EVENTS_SECTION_LEN];
+} wifi_events_t;
+
+static const char *const wifi_events_include[WIFI_EVENTS_SECTIONS] = { "wifi.ap", "wifi.sta" };
+
+static wifi_events_t *wifi_events;
+static volatile int wifi_events_clients;
+static volatile bool wifi_events_queued;
+#if CONFIG_HTTPD_WIFI_EVENTS_RSSI_INTERVAL > 0
+static TimerHandle_t wifi_events_timer;
+#endif
+
+//render interface state once for all subscribers, returns bit per changed section
+static uint8_t wifi_events_update(void)
+{
+    esp_httpd_json_t jw;
+    char buf[WIFI_EVENTS_SECTION_LEN];
+    uint8_t changed = 0;
+
+    for (int i = 0; i < WIFI_EVENTS_SECTIONS; i++) {
+        esp_httpd_batch_t sel = { .include = wifi_events_include[i], .name = "wifi" };
+
+        esp_httpd_json_begin_buf(&jw, NULL, buf, sizeof(buf));
+        esp_httpd_wifi_info_section(&jw, &sel, NULL);
+        if (esp_httpd_json_end(&jw) != ESP_OK)
+            continue;
+
+        //members without braces of root object
+        size_t len = jw.out_len - 2;
+        if (len != wifi_events->state_len[i] || memcmp(wifi_events->state[i], buf + 1, len)) {
+            memcpy(wifi_events->state[i], buf + 1, len);
+            wifi_events->state_len[i] = len;
+            changed |= 1 << i;
+        }
+    }
+    return changed;
+}
+
+static size_t wifi_events_message(uint8_t sections)
+{
+    char *msg = wifi_events->msg;
+    size_t len = sprintf(msg, "event: wifi\ndata: {");
+
+    for (int i = 0; i < WIFI_EVENTS_SECTIONS; i++) {
+        if (!(sections & (1 << i)) || !wifi_events->state_len[i])
+            continue;
+        if (msg[len - 1] != '{')
+            msg[len++] = ',';
+        memcpy(msg + len, wifi_events->state[i], wifi_events->state_len[i]);
+        len += wifi_events->state_len[i];
+    }
+    len += sprintf(msg + len, "}\n\n");
+    return len;
+}
+
+//response headers are long gone, message is framed as chunk by hand
+static esp_err_t wifi_events_send(int fd, const char *msg, size_t len)
+{
+    char head[12];
+    int head_len = sprintf(head, "%x\r\n", len);
+
+    if (httpd_socket_send(wifi_events->server, fd, head, head_len, 0) != head_len ||
+        httpd_socket_send(wifi_events->server, fd, msg, len, 0) != len ||
+        httpd_socket_send(wifi_events->server, fd, "\r\n", 2, 0) != 2)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+static void wifi_events_push(void *arg)
+{
+    wifi_events_queued = false;
+
+    uint8_t changed = wifi_events_update();
+    if (!changed)
+        return;
+
+    size_t len = wifi_events_message(changed);
+    for (int i = 0; i < CONFIG_HTTPD_WIFI_EVENTS_MAX_CLIENTS; i++) {
+        int fd = wifi_events->fds[i];
+        //slot is freed by wifi_events_unsubscribe when session closes
+        if (fd >= 0 && wifi_events_send(fd, wifi_events->msg, len) != ESP_OK)
+            httpd_sess_trigger_close(wifi_events->server, fd);
+    }
+}
+
+//called from event loop and timer task, state is read in HTTPD task
+static void wifi_events_queue(void)
+{
+    if (!wifi_events || wifi_events_clients == 0 || wifi_events_queued)
+        return;
+    wifi_events_queued = true;
+    if (httpd_queue_work(wifi_events->server, wifi_events_push, NULL) != ESP_OK)
+        wifi_events_queued = false;
+}
+
+static void wifi_events_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    wifi_events_queue();
+}
+
+#if CONFIG_HTTPD_WIFI_EVENTS_RSSI_INTERVAL > 0
+static void wifi_events_sample(TimerHandle_t timer)
+{
+    wifi_events_queue();
+}
+#endif
+
+//Wi-Fi and IP events and RSSI samples are watched only while someone is subscribed
+static void wifi_events_listen(bool on)
+{
+    if (on) {
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_events_handler, NULL));
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_event_handler_register(IP_EVENT, ESP_EVENT_ANY_ID, wifi_events_handler, NULL));
     } else {
-        cJSON_AddItemToObject(js, "data", wifi_info_to_json());
+        esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_events_handler);
+        esp_event_handler_unregister(IP_EVENT, ESP_EVENT_ANY_ID, wifi_events_handler);
+    }
+#if CONFIG_HTTPD_WIFI_EVENTS_RSSI_INTERVAL > 0
+    if (wifi_events_timer) {
+        if (on)
+            xTimerStart(wifi_events_timer, 0);
+        else
+            xTimerStop(wifi_events_timer, 0);
+    }
+#endif
+}
+
+//session free_ctx, also called for open streams by httpd_stop
+static void wifi_events_unsubscribe(void *ctx)
+{
+    int *fd = ctx;
+
+    ESP_LOGI(TAG, "event stream %d closed", *fd);
+    *fd = -1;
+    if (--wifi_events_clients == 0)
+        wifi_events_listen(false);
+}
+
+static esp_err_t wifi_events_init(void)
+{
+    if (wifi_events)
+        return ESP_OK;
+
+    wifi_events_t *ev = calloc(1, sizeof(wifi_events_t));
+    if (!ev)
+        return ESP_ERR_NO_MEM;
+    for (int i = 0; i < CONFIG_HTTPD_WIFI_EVENTS_MAX_CLIENTS; i++)
+        ev->fds[i] = -1;
+#if CONFIG_HTTPD_WIFI_EVENTS_RSSI_INTERVAL > 0
+    wifi_events_timer = xTimerCreate("wifi_events", pdMS_TO_TICKS(1000 * CONFIG_HTTPD_WIFI_EVENTS_RSSI_INTERVAL),
+                                     pdTRUE, NULL, wifi_events_sample);
+#endif
+    wifi_events = ev;
+    return ESP_OK;
+}
+
+esp_err_t esp_httpd_wifi_events_handler(httpd_req_t *req)
+{
+    int slot = -1;
+    esp_err_t rc;
+
+    CHECK_ARG(req);
+
+    rc = wifi_events_init();
+    if (rc != ESP_OK)
+        return rc;
+    //server may have been restarted since last subscribe, its streams were closed with it
+    wifi_events->server = req->handle;
+
+    for (int i = 0; i < CONFIG_HTTPD_WIFI_EVENTS_MAX_CLIENTS && slot < 0; i++) {
+        if (wifi_events->fds[i] < 0)
+            slot = i;
+    }
+    if (slot < 0) {
+        //EventSource gives up on error status, page falls back to polling
+        ESP_LOGW(TAG, "no free event stream slot");
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_send(req, NULL, 0);
     }
-    return esp_httpd_resp_json(req, js);
+
+    //bring snapshot up to date for everyone, then send it whole to new client
+    wifi_events_push(NULL);
+    size_t len = wifi_events_message((1 << WIFI_EVENTS_SECTIONS) - 1);
+
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    rc = httpd_resp_send_chunk(req, WIFI_EVENTS_RETRY, sizeof(WIFI_EVENTS_RETRY) - 1);
+    if (rc == ESP_OK)
+        rc = httpd_resp_send_chunk(req, wifi_events->msg, len);
+    if (rc != ESP_OK)
+        return rc;
+
+    //response stays open, messages follow as chunks until client leaves
+    wifi_events->fds[slot] = httpd_req_to_sockfd(req);
+    req->sess_ctx = &wifi_events->fds[slot];
+    req->free_ctx = wifi_events_unsubscribe;
+    if (wifi_events_clients++ == 0)
+        wifi_events_listen(true);
+    ESP_LOGI(TAG, "event stream %d open", wifi_events->fds[slot]);
+    return ESP_OK;
 }
@@ -8,11 +8,28 @@
 #include <esp_system.h>
 #include <esp_log.h>
 #include <sys/param.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <mbedtls/version.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#ifdef CONFIG_HTTPD_FOTA_DECOMPRESS
+#include <miniz.h>
+#include <esp_rom_crc.h>
+#endif
 
 #include "include/esp_http_server_misc.h"
 #include "esp_http_upload.h"
 
 static const char *TAG = "UPLOAD";
+static const int UPLOAD_RECV_TIMEOUT_RETRIES = 3;
+
+#define STR(X) #X
+#define XSTR(X) STR(X)
+#define UPLOAD_RETRY_AFTER XSTR(CONFIG_HTTPD_UPLOAD_RETRY_AFTER)
+#define UPLOAD_STATUS_MAX 8 //uploads listed by admission handler
 
 static bool get_boundary_str(const char *content, char *boundary)
 {
@@ -67,108 +84,1752 @@ esp_err_t esp_http_get_boundary(httpd_req_t *req, char *boundary)
     return rc;
 }
 
-int esp_http_upload_check_initial_boundary(httpd_req_t *req, char *boundary, size_t bytes_left)
+static int multipart_fill(esp_http_multipart_t *mp)
 {
-    char buf[BOUNDARY_LEN] = { 0 };
-    ssize_t boundary_len = strlen(boundary);
-    uint32_t bytes_read = 0;
     int recv;
+    int timeout_retries = 0;
 
-    if (bytes_left < boundary_len)
-        return -1;
+    //move unconsumed data to the beginning of the buffer
+    if (mp->head > 0) {
+        memmove(mp->buf, mp->buf + mp->head, mp->tail - mp->head);
+        mp->tail -= mp->head;
+        mp->head = 0;
+    }
+
+    if (mp->bytes_left == 0 || mp->tail == mp->buf_size)
+        return 0;
 
-    while (bytes_left > 0) {
-        recv = httpd_req_recv(req, buf + bytes_read, (boundary_len - bytes_read));
+    while (true) {
+        recv = httpd_req_recv(mp->req, mp->buf + mp->tail, MIN(mp->bytes_left, mp->buf_size - mp->tail));
         if (recv < 0) {
-            if (recv == HTTPD_SOCK_ERR_TIMEOUT)
+            // Retry receiving if timeout occurred
+            if (recv == HTTPD_SOCK_ERR_TIMEOUT && ++timeout_retries < UPLOAD_RECV_TIMEOUT_RETRIES)
                 continue;
-            ESP_LOGE(TAG, "httpd_req_recv error: err=0x%x", recv);
+            ESP_LOGE(TAG, "httpd_req_recv error: err=%d", recv);
+            return -1;
+        }
+        if (recv == 0) {
+            ESP_LOGE(TAG, "httpd_req_recv returned 0, client disconnected");
             return -1;
         }
-        bytes_read += recv;
-        bytes_left -= recv;
+        break;
+    }
+    mp->tail += recv;
+    mp->bytes_left -= recv;
+    return recv;
+}
+
+//make sure at least len bytes are available at head
+static esp_err_t multipart_require(esp_http_multipart_t *mp, size_t len)
+{
+    while (mp->tail - mp->head < len) {
+        if (mp->bytes_left == 0) {
+            ESP_LOGE(TAG, "unexpected end of multipart data");
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (multipart_fill(mp) < 0)
+            return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static const char *multipart_find(const char *buf, size_t len, const char *seq, size_t seq_len)
+{
+    for (size_t i = 0; i + seq_len <= len; i++) {
+        if (buf[i] == seq[0] && memcmp(buf + i, seq, seq_len) == 0)
+            return buf + i;
+    }
+    return NULL;
+}
+
+static void multipart_build_skip_table(esp_http_multipart_t *mp)
+{
+    size_t last = mp->delim_len - 1;
+
+    memset(mp->skip, mp->delim_len, sizeof(mp->skip));
+    for (size_t i = 0; i < last; i++)
+        mp->skip[(uint8_t)mp->delim[i]] = last - i;
+}
+
+/* Scan buffer for delimiter. Returns delimiter offset and sets found flag, or
+number of bytes which cannot be a part of delimiter if there is no match */
+static size_t multipart_scan(const esp_http_multipart_t *mp, const char *buf, size_t len, bool *found)
+{
+    const char *delim = mp->delim;
+    size_t last = mp->delim_len - 1;
+    size_t i = 0;
+
+    *found = false;
+    while (i + last < len) {
+        uint8_t c = buf[i + last];
+        if (c == (uint8_t)delim[last] && memcmp(buf + i, delim, last) == 0) {
+            *found = true;
+            return i;
+        }
+        i += mp->skip[c];
+    }
 
-        if (bytes_read == boundary_len)
+    //shift table guarantees no partial match before i, check buffer end
+    for (; i < len; i++) {
+        if (buf[i] == delim[0] && memcmp(buf + i, delim, len - i) == 0)
             break;
     }
+    return i;
+}
 
-    if (strncmp(buf, boundary, strlen(boundary)) != 0) {
-        ESP_LOGE(TAG, "initial boundary not found");
-        return -1;
+//copy parameter value like: name="firmware" from header line
+static void multipart_get_param(const char *line, const char *param, char *value, size_t value_len)
+{
+    size_t param_len = strlen(param);
+    const char *p = line;
+
+    while ((p = strchr(p, ';')) != NULL) {
+        p++;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (strncasecmp(p, param, param_len) != 0 || p[param_len] != '=')
+            continue;
+
+        p += param_len + 1;
+        bool quoted = (*p == '"');
+        if (quoted)
+            p++;
+
+        size_t i = 0;
+        while (*p && i < value_len - 1) {
+            if (quoted ? (*p == '"') : (*p == ';' || *p == ' '))
+                break;
+            value[i++] = *p++;
+        }
+        value[i] = '\0';
+        return;
     }
-    return bytes_read;
 }
 
-int esp_http_upload_find_multipart_header_end(httpd_req_t *req, size_t bytes_left)
+static void multipart_parse_header(esp_http_multipart_t *mp, const char *line)
 {
-    const char seq[] = "\r\n\r\n";
-    char buf[4] = { 0 };
-    uint32_t bytes_read = 0;
-    int recv;
-    uint8_t match = 0;
+    static const char content_disposition[] = "Content-Disposition:";
+    static const char content_type[] = "Content-Type:";
+    static const char content_encoding[] = "Content-Encoding:";
 
-    //read byte by byte to find CRLF CRLF sequence
-    while (bytes_left > 0) {
-        recv = httpd_req_recv(req, buf, 1);
-        if (recv < 0) {
-            // Retry receive if timeout occurred
-            if (recv == HTTPD_SOCK_ERR_TIMEOUT)
-                continue;
-            ESP_LOGE(TAG, "httpd_req_recv error: err=0x%x", recv);
-            return -1;
+    ESP_LOGD(TAG, "part header: %s", line);
+    if (strncasecmp(line, content_disposition, sizeof(content_disposition) - 1) == 0) {
+        multipart_get_param(line, "name", mp->part.name, sizeof(mp->part.name));
+        multipart_get_param(line, "filename", mp->part.filename, sizeof(mp->part.filename));
+    } else if (strncasecmp(line, content_type, sizeof(content_type) - 1) == 0) {
+        line += sizeof(content_type) - 1;
+        while (*line == ' ' || *line == '\t')
+            line++;
+        snprintf(mp->part.content_type, sizeof(mp->part.content_type), "%s", line);
+    } else if (strncasecmp(line, content_encoding, sizeof(content_encoding) - 1) == 0) {
+        line += sizeof(content_encoding) - 1;
+        while (*line == ' ' || *line == '\t')
+            line++;
+        snprintf(mp->part.encoding, sizeof(mp->part.encoding), "%s", line);
+    }
+}
+
+static esp_err_t multipart_skip_preamble(esp_http_multipart_t *mp)
+{
+    size_t avail;
+    bool found;
+
+    while (true) {
+        avail = multipart_scan(mp, mp->buf + mp->head, mp->tail - mp->head, &found);
+        mp->head += avail;
+        if (found)
+            return ESP_OK;
+
+        if (mp->bytes_left == 0) {
+            ESP_LOGE(TAG, "initial boundary not found");
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (multipart_fill(mp) < 0)
+            return ESP_FAIL;
+    }
+}
+
+static esp_err_t multipart_parse_headers(esp_http_multipart_t *mp)
+{
+    static const char seq[] = "\r\n\r\n";
+    const char *end;
+    char line[128];
+
+    /* Header block starts with CRLF which follows the boundary, so even a part
+    without headers is terminated with CRLF CRLF */
+    while (true) {
+        end = multipart_find(mp->buf + mp->head, mp->tail - mp->head, seq, 4);
+        if (end)
+            break;
+        if (mp->head == 0 && mp->tail == mp->buf_size) {
+            ESP_LOGE(TAG, "multipart header too long");
+            return ESP_ERR_INVALID_SIZE;
+        }
+        if (mp->bytes_left == 0) {
+            ESP_LOGE(TAG, "CRLF CRLF seq not found");
+            return ESP_ERR_INVALID_RESPONSE;
         }
-        bytes_read += recv;
-        bytes_left -= recv;
+        if (multipart_fill(mp) < 0)
+            return ESP_FAIL;
+    }
+
+    memset(&mp->part, 0, sizeof(mp->part));
+    const char *p = mp->buf + mp->head + 2;
+    while (p < end + 2) {
+        const char *eol = multipart_find(p, end + 2 - p, "\r\n", 2);
+        size_t len = MIN(eol - p, sizeof(line) - 1);
+        memcpy(line, p, len);
+        line[len] = '\0';
+        multipart_parse_header(mp, line);
+        p = eol + 2;
+    }
+    mp->head = end + 4 - mp->buf;
+    return ESP_OK;
+}
+
+/* HTTPD receives request body only up to Content-Length, which is 0 with
+Transfer-Encoding, and its parser consumes size line of the first chunk */
+static bool multipart_is_chunked(httpd_req_t *req)
+{
+    return httpd_req_get_hdr_value_len(req, "Transfer-Encoding") > 0;
+}
+
+//request body without multipart framing, e.g. application/octet-stream
+static bool multipart_is_raw(httpd_req_t *req)
+{
+    char type[16] = { 0 };
+
+    //truncated value is still copied, prefix is enough
+    httpd_req_get_hdr_value_str(req, "Content-Type", type, sizeof(type));
+    return type[0] && strncasecmp(type, "multipart/", 10) != 0;
+}
+
+//single part described by request headers
+static void multipart_raw_part(esp_http_multipart_t *mp)
+{
+    static const char *const headers[] = { "Content-Disposition", "Content-Type", "Content-Encoding" };
+    char line[128];
+    size_t len;
+
+    memset(&mp->part, 0, sizeof(mp->part));
+    strcpy(mp->part.name, "file");
+    for (int i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+        len = snprintf(line, sizeof(line), "%s: ", headers[i]);
+        if (httpd_req_get_hdr_value_str(mp->req, headers[i], line + len, sizeof(line) - len) != ESP_ERR_NOT_FOUND)
+            multipart_parse_header(mp, line);
+    }
+}
+
+esp_err_t esp_http_multipart_begin(esp_http_multipart_t *mp, httpd_req_t *req)
+{
+    char boundary[BOUNDARY_LEN] = { 0 };
+    esp_err_t rc;
+
+    CHECK_ARG(mp);
+    CHECK_ARG(req);
+
+    memset(mp, 0, sizeof(esp_http_multipart_t));
+    if (multipart_is_chunked(req)) {
+        ESP_LOGE(TAG, "chunked request body not supported, Content-Length required");
+        //body is not drained by HTTPD, do not parse it as next request
+        httpd_resp_set_status(req, "411 Length Required");
+        httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    if (multipart_is_raw(req)) {
+        mp->buf_size = UPLOAD_BUF_LEN;
+        mp->buf = malloc(mp->buf_size);
+        if (!mp->buf)
+            return ESP_ERR_NO_MEM;
+
+        mp->raw = true;
+        mp->req = req;
+        mp->bytes_left = req->content_len;
+        mp->state = ESP_HTTP_MULTIPART_PREAMBLE;
+        ESP_LOGD(TAG, "raw request body");
+        return ESP_OK;
+    }
+
+    rc = esp_http_get_boundary(req, boundary);
+    if (rc != ESP_OK)
+        return rc;
+
+    mp->buf_size = UPLOAD_BUF_LEN;
+    mp->buf = malloc(mp->buf_size);
+    if (!mp->buf)
+        return ESP_ERR_NO_MEM;
+
+    //delimiter is CRLF + boundary, initial boundary may follow body start directly
+    mp->delim_len = snprintf(mp->delim, sizeof(mp->delim), "\r\n%s", boundary);
+    multipart_build_skip_table(mp);
+    memcpy(mp->buf, "\r\n", 2);
+    mp->tail = 2;
+    mp->req = req;
+    mp->bytes_left = req->content_len;
+    mp->state = ESP_HTTP_MULTIPART_PREAMBLE;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_multipart_next_part(esp_http_multipart_t *mp)
+{
+    const char *data;
+    esp_err_t rc;
+    int len;
 
-        (buf[0] == seq[match]) ? (match++) : (match = 0);
-        if (match == 4)
-            break; // CRLF CRLF sequence found
+    CHECK_ARG(mp);
+    while (true) {
+        switch (mp->state) {
+        case ESP_HTTP_MULTIPART_PREAMBLE:
+            if (mp->raw) {
+                //whole body is the only part
+                multipart_raw_part(mp);
+                mp->state = ESP_HTTP_MULTIPART_BODY;
+                return ESP_OK;
+            }
+            //skip any preamble data before initial boundary
+            rc = multipart_skip_preamble(mp);
+            if (rc != ESP_OK)
+                return rc;
+            mp->head += mp->delim_len;
+            mp->state = ESP_HTTP_MULTIPART_DELIMITER;
+            break;
+        case ESP_HTTP_MULTIPART_DELIMITER:
+            rc = multipart_require(mp, 2);
+            if (rc != ESP_OK)
+                return rc;
+            if (memcmp(mp->buf + mp->head, "--", 2) == 0) {
+                mp->head += 2;
+                mp->state = ESP_HTTP_MULTIPART_DONE;
+            } else if (mp->buf[mp->head] == ' ' || mp->buf[mp->head] == '\t') {
+                mp->head++; //transport padding
+            } else if (memcmp(mp->buf + mp->head, "\r\n", 2) == 0) {
+                mp->state = ESP_HTTP_MULTIPART_HEADERS; //CRLF is a part of header block
+            } else {
+                ESP_LOGE(TAG, "invalid boundary delimiter");
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            break;
+        case ESP_HTTP_MULTIPART_HEADERS:
+            rc = multipart_parse_headers(mp);
+            if (rc != ESP_OK)
+                return rc;
+            mp->state = ESP_HTTP_MULTIPART_BODY;
+            ESP_LOGD(TAG, "part name=%s filename=%s type=%s", mp->part.name, mp->part.filename, mp->part.content_type);
+            return ESP_OK;
+        case ESP_HTTP_MULTIPART_BODY:
+            //skip rest of current part
+            while ((len = esp_http_multipart_read(mp, &data)) > 0)
+                ;
+            if (len < 0)
+                return ESP_FAIL;
+            if (mp->raw)
+                mp->state = ESP_HTTP_MULTIPART_DONE;
+            break;
+        case ESP_HTTP_MULTIPART_DONE:
+        default:
+            //discard epilogue
+            mp->head = mp->tail;
+            while (mp->bytes_left > 0) {
+                if (multipart_fill(mp) < 0)
+                    return ESP_FAIL;
+                mp->head = mp->tail;
+            }
+            return ESP_ERR_NOT_FOUND;
+        }
     }
-    if (match != 4) {
-        ESP_LOGE(TAG, "CRLF CRLF seq not found");
+}
+
+int esp_http_multipart_read(esp_http_multipart_t *mp, const char **data)
+{
+    size_t avail;
+    bool found;
+
+    if (!mp || !data)
         return -1;
+
+    if (mp->state != ESP_HTTP_MULTIPART_BODY)
+        return 0;
+
+    if (mp->raw) {
+        //no framing, hand out received blocks as they are
+        if (mp->head == mp->tail) {
+            if (mp->bytes_left == 0)
+                return 0;
+            if (multipart_fill(mp) < 0)
+                return -1;
+        }
+        avail = mp->tail - mp->head;
+        *data = mp->buf + mp->head;
+        mp->head = mp->tail;
+        return avail;
+    }
+
+    while (true) {
+        avail = multipart_scan(mp, mp->buf + mp->head, mp->tail - mp->head, &found);
+        if (found && avail == 0) {
+            //part body complete
+            mp->head += mp->delim_len;
+            mp->state = ESP_HTTP_MULTIPART_DELIMITER;
+            return 0;
+        }
+
+        if (avail > 0) {
+            *data = mp->buf + mp->head;
+            mp->head += avail;
+            return avail;
+        }
+
+        if (mp->bytes_left == 0) {
+            ESP_LOGE(TAG, "final boundary not found");
+            return -1;
+        }
+        if (multipart_fill(mp) < 0)
+            return -1;
     }
-    return bytes_read;
 }
 
-//receive and check final boundary
-int esp_http_upload_check_final_boundary(httpd_req_t *req, char *boundary, size_t bytes_left)
+void esp_http_multipart_end(esp_http_multipart_t *mp)
 {
-    char buf[BOUNDARY_LEN + 2] = { 0 }; //additional '--' at the end
-    ssize_t boundary_len = strlen(boundary);
-    uint32_t bytes_read = 0;
-    int recv;
+    if (!mp)
+        return;
+    free(mp->buf);
+    mp->buf = NULL;
+}
 
-    while (bytes_left > 0) {
-        recv = httpd_req_recv(req, buf, MIN(bytes_left, UPLOAD_BUF_LEN));
-        if (recv < 0) {
-            // Retry receiving if timeout occurred
-            if (recv == HTTPD_SOCK_ERR_TIMEOUT)
+esp_err_t esp_http_upload_coalesce_init(esp_http_upload_coalesce_t *c, size_t size, esp_http_upload_flush_t flush,
+                                        void *ctx)
+{
+    CHECK_ARG(c);
+    CHECK_ARG(size);
+    CHECK_ARG(flush);
+
+    c->buf = malloc(size);
+    if (!c->buf)
+        return ESP_ERR_NO_MEM;
+
+    c->size = size;
+    c->len = 0;
+    c->flush = flush;
+    c->ctx = ctx;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_coalesce_write(esp_http_upload_coalesce_t *c, const char *data, size_t len)
+{
+    esp_err_t rc;
+    size_t n;
+
+    while (len > 0) {
+        if (c->len == 0 && len >= c->size) {
+            //whole blocks are passed to sink directly, without copy
+            n = len - len % c->size;
+            rc = c->flush(c->ctx, data, n);
+            if (rc != ESP_OK)
+                return rc;
+        } else {
+            n = MIN(len, c->size - c->len);
+            memcpy(c->buf + c->len, data, n);
+            c->len += n;
+            if (c->len == c->size) {
+                rc = esp_http_upload_coalesce_flush(c);
+                if (rc != ESP_OK)
+                    return rc;
+            }
+        }
+        data += n;
+        len -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_coalesce_flush(esp_http_upload_coalesce_t *c)
+{
+    esp_err_t rc = ESP_OK;
+
+    if (c->len > 0) {
+        rc = c->flush(c->ctx, c->buf, c->len);
+        c->len = 0;
+    }
+    return rc;
+}
+
+void esp_http_upload_coalesce_free(esp_http_upload_coalesce_t *c)
+{
+    free(c->buf);
+    c->buf = NULL;
+    c->len = 0;
+}
+
+static esp_err_t coalesce_stage_write(void *ctx, const char *data, size_t len)
+{
+    return esp_http_upload_coalesce_write(ctx, data, len);
+}
+
+static esp_err_t coalesce_stage_finish(void *ctx)
+{
+    return esp_http_upload_coalesce_flush(ctx);
+}
+
+static void coalesce_stage_free(void *ctx)
+{
+    esp_http_upload_coalesce_free(ctx);
+}
+
+const esp_http_upload_stage_ops_t esp_http_upload_coalesce_ops = {
+    .write = coalesce_stage_write,
+    .finish = coalesce_stage_finish,
+    .free = coalesce_stage_free,
+};
+
+static bool sector_is_blank(const esp_partition_t *part, size_t offset)
+{
+    uint32_t buf[64];
+
+    //decrypted content of erased flash is not blank
+    if (part->encrypted)
+        return false;
+
+    for (size_t pos = 0; pos < SPI_FLASH_SEC_SIZE; pos += sizeof(buf)) {
+        if (esp_partition_read(part, offset + pos, buf, sizeof(buf)) != ESP_OK)
+            return false;
+        for (int i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) {
+            if (buf[i] != UINT32_MAX)
+                return false;
+        }
+    }
+    return true;
+}
+
+void esp_http_upload_erase_init(esp_http_upload_erase_t *e, const esp_partition_t *part)
+{
+    e->part = part;
+    e->erased = 0;
+}
+
+esp_err_t esp_http_upload_erase_range(esp_http_upload_erase_t *e, size_t offset, size_t len)
+{
+    size_t start = MAX(e->erased, offset - offset % SPI_FLASH_SEC_SIZE);
+    size_t end = offset + len;
+    size_t run_start = start;
+    size_t run_len = 0;
+    esp_err_t rc;
+
+    if (end > e->part->size)
+        return ESP_ERR_INVALID_SIZE;
+
+    end = MIN(e->part->size, ((end + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE) * SPI_FLASH_SEC_SIZE);
+    for (size_t sector = start; sector < end; sector += SPI_FLASH_SEC_SIZE) {
+        if (sector_is_blank(e->part, sector)) {
+            if (run_len > 0) {
+                rc = esp_partition_erase_range(e->part, run_start, run_len);
+                if (rc != ESP_OK)
+                    return rc;
+            }
+            run_start = sector + SPI_FLASH_SEC_SIZE;
+            run_len = 0;
+        } else {
+            run_len += SPI_FLASH_SEC_SIZE;
+        }
+    }
+
+    if (run_len > 0) {
+        rc = esp_partition_erase_range(e->part, run_start, run_len);
+        if (rc != ESP_OK)
+            return rc;
+    }
+    ESP_LOGD(TAG, "erased up to 0x%x", end);
+    e->erased = MAX(e->erased, end);
+    return ESP_OK;
+}
+
+#define SPARSE_CHUNK_RAW 0xcac1
+#define SPARSE_CHUNK_FILL 0xcac2
+#define SPARSE_CHUNK_DONT_CARE 0xcac3
+#define SPARSE_CHUNK_CRC32 0xcac4
+#define SPARSE_FILE_HDR_SZ 28
+#define SPARSE_CHUNK_HDR_SZ 12
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void esp_http_upload_sparse_init(esp_http_upload_sparse_t *sp, uint32_t blk_align, esp_http_upload_flush_t write,
+                                 esp_http_upload_fill_t fill, void *ctx)
+{
+    memset(sp, 0, sizeof(esp_http_upload_sparse_t));
+    sp->state = ESP_HTTP_SPARSE_DETECT;
+    sp->hdr_need = sizeof(uint32_t);
+    sp->blk_align = blk_align ? blk_align : 1;
+    sp->write = write;
+    sp->fill = fill;
+    sp->ctx = ctx;
+}
+
+//skip len bytes and continue in next state
+static void sparse_skip(esp_http_upload_sparse_t *sp, size_t len, esp_http_sparse_state_t next)
+{
+    sp->skip = len;
+    sp->next = next;
+    sp->state = len ? ESP_HTTP_SPARSE_SKIP : next;
+}
+
+static void sparse_next_chunk(esp_http_upload_sparse_t *sp)
+{
+    sp->hdr_len = 0;
+    sp->hdr_need = SPARSE_CHUNK_HDR_SZ;
+    sp->state = (sp->chunks_done < sp->total_chunks) ? ESP_HTTP_SPARSE_CHUNK_HEADER : ESP_HTTP_SPARSE_DONE;
+}
+
+static esp_err_t sparse_parse_file_header(esp_http_upload_sparse_t *sp)
+{
+    const uint8_t *h = sp->hdr;
+    size_t file_hdr_sz = get_le16(h + 8);
+
+    sp->chunk_hdr_sz = get_le16(h + 10);
+    sp->blk_sz = get_le32(h + 12);
+    sp->total_chunks = get_le32(h + 20);
+
+    if (get_le16(h + 4) != 1 || file_hdr_sz < SPARSE_FILE_HDR_SZ || sp->chunk_hdr_sz < SPARSE_CHUNK_HDR_SZ) {
+        ESP_LOGE(TAG, "unsupported sparse image version");
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (sp->blk_sz == 0 || sp->blk_sz % sp->blk_align) {
+        ESP_LOGE(TAG, "sparse block size %" PRIu32 " not aligned to %" PRIu32, sp->blk_sz, sp->blk_align);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    ESP_LOGI(TAG, "sparse image: %" PRIu32 " blocks of %" PRIu32 " bytes in %" PRIu32 " chunks", get_le32(h + 16),
+             sp->blk_sz, sp->total_chunks);
+
+    sparse_next_chunk(sp);
+    sparse_skip(sp, file_hdr_sz - SPARSE_FILE_HDR_SZ, sp->state);
+    return ESP_OK;
+}
+
+static esp_err_t sparse_parse_chunk_header(esp_http_upload_sparse_t *sp)
+{
+    const uint8_t *h = sp->hdr;
+    uint16_t type = get_le16(h);
+    uint32_t chunk_sz = get_le32(h + 4);
+    uint32_t total_sz = get_le32(h + 8);
+    size_t extra = sp->chunk_hdr_sz - SPARSE_CHUNK_HDR_SZ;
+    esp_err_t rc = ESP_OK;
+
+    //sizes come from client, refuse values which would wrap
+    if (total_sz < sp->chunk_hdr_sz || chunk_sz > SIZE_MAX / sp->blk_sz) {
+        ESP_LOGE(TAG, "bad sparse chunk size %" PRIu32 "/%" PRIu32, chunk_sz, total_sz);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t size = (size_t)chunk_sz * sp->blk_sz;
+    size_t data_len = total_sz - sp->chunk_hdr_sz;
+
+    sp->chunks_done++;
+    switch (type) {
+    case SPARSE_CHUNK_RAW:
+        if (data_len != size)
+            return ESP_ERR_INVALID_SIZE;
+        sp->image_size += size;
+        sp->remaining = size;
+        sparse_skip(sp, extra, ESP_HTTP_SPARSE_RAW);
+        return ESP_OK;
+    case SPARSE_CHUNK_FILL:
+        if (data_len != sizeof(uint32_t))
+            return ESP_ERR_INVALID_SIZE;
+        //fill value follows chunk header, fill is done when it is received
+        sp->image_size += size;
+        sp->remaining = size;
+        sp->hdr_len = 0;
+        sp->hdr_need = sizeof(uint32_t);
+        sparse_skip(sp, extra, ESP_HTTP_SPARSE_FILL);
+        return ESP_OK;
+    case SPARSE_CHUNK_DONT_CARE:
+        if (data_len != 0)
+            return ESP_ERR_INVALID_SIZE;
+        sp->image_size += size;
+        rc = sp->fill(sp->ctx, NULL, size);
+        break;
+    case SPARSE_CHUNK_CRC32:
+        if (data_len != sizeof(uint32_t))
+            return ESP_ERR_INVALID_SIZE;
+        break;
+    default:
+        ESP_LOGE(TAG, "sparse chunk type 0x%04x not supported", type);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (rc != ESP_OK)
+        return rc;
+
+    sparse_next_chunk(sp);
+    sparse_skip(sp, extra + data_len, sp->state);
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_sparse_write(esp_http_upload_sparse_t *sp, const char *data, size_t len)
+{
+    esp_err_t rc;
+    size_t n;
+
+    while (len > 0) {
+        switch (sp->state) {
+        case ESP_HTTP_SPARSE_DETECT:
+        case ESP_HTTP_SPARSE_FILE_HEADER:
+        case ESP_HTTP_SPARSE_CHUNK_HEADER:
+        case ESP_HTTP_SPARSE_FILL:
+            n = MIN(len, sp->hdr_need - sp->hdr_len);
+            memcpy(sp->hdr + sp->hdr_len, data, n);
+            sp->hdr_len += n;
+            data += n;
+            len -= n;
+            if (sp->hdr_len < sp->hdr_need)
+                break;
+
+            if (sp->state == ESP_HTTP_SPARSE_DETECT) {
+                if (get_le32(sp->hdr) != SPARSE_HEADER_MAGIC) {
+                    //not a sparse image, pass collected bytes and all data below
+                    sp->state = ESP_HTTP_SPARSE_PASSTHROUGH;
+                    rc = sp->write(sp->ctx, (const char *)sp->hdr, sp->hdr_len);
+                    if (rc != ESP_OK)
+                        return rc;
+                    sp->image_size += sp->hdr_len;
+                } else {
+                    sp->state = ESP_HTTP_SPARSE_FILE_HEADER;
+                    sp->hdr_need = SPARSE_FILE_HDR_SZ;
+                }
+            } else if (sp->state == ESP_HTTP_SPARSE_FILE_HEADER) {
+                rc = sparse_parse_file_header(sp);
+                if (rc != ESP_OK)
+                    return rc;
+            } else if (sp->state == ESP_HTTP_SPARSE_CHUNK_HEADER) {
+                rc = sparse_parse_chunk_header(sp);
+                if (rc != ESP_OK)
+                    return rc;
+            } else {
+                memcpy(&sp->fill_value, sp->hdr, sizeof(uint32_t));
+                rc = sp->fill(sp->ctx, &sp->fill_value, sp->remaining);
+                if (rc != ESP_OK)
+                    return rc;
+                sparse_next_chunk(sp);
+            }
+            break;
+        case ESP_HTTP_SPARSE_PASSTHROUGH:
+        case ESP_HTTP_SPARSE_RAW:
+            if (sp->state == ESP_HTTP_SPARSE_RAW && sp->remaining == 0) {
+                sparse_next_chunk(sp); //empty chunk
+                break;
+            }
+            n = (sp->state == ESP_HTTP_SPARSE_RAW) ? MIN(len, sp->remaining) : len;
+            rc = sp->write(sp->ctx, data, n);
+            if (rc != ESP_OK)
+                return rc;
+            data += n;
+            len -= n;
+            if (sp->state == ESP_HTTP_SPARSE_PASSTHROUGH) {
+                sp->image_size += n;
+            } else {
+                sp->remaining -= n;
+                if (sp->remaining == 0)
+                    sparse_next_chunk(sp);
+            }
+            break;
+        case ESP_HTTP_SPARSE_SKIP:
+            n = MIN(len, sp->skip);
+            data += n;
+            len -= n;
+            sp->skip -= n;
+            if (sp->skip == 0)
+                sp->state = sp->next;
+            break;
+        case ESP_HTTP_SPARSE_DONE:
+        default:
+            //ignore data after last chunk
+            return ESP_OK;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_sparse_finish(esp_http_upload_sparse_t *sp)
+{
+    switch (sp->state) {
+    case ESP_HTTP_SPARSE_PASSTHROUGH:
+    case ESP_HTTP_SPARSE_DONE:
+        return ESP_OK;
+    case ESP_HTTP_SPARSE_DETECT:
+        //image shorter than magic
+        if (sp->hdr_len > 0)
+            return sp->write(sp->ctx, (const char *)sp->hdr, sp->hdr_len);
+        return ESP_OK;
+    default:
+        ESP_LOGE(TAG, "sparse image truncated, %" PRIu32 "/%" PRIu32 " chunks", sp->chunks_done, sp->total_chunks);
+        return ESP_ERR_INVALID_SIZE;
+    }
+}
+
+static esp_err_t sparse_stage_write(void *ctx, const char *data, size_t len)
+{
+    return esp_http_upload_sparse_write(ctx, data, len);
+}
+
+static esp_err_t sparse_stage_finish(void *ctx)
+{
+    return esp_http_upload_sparse_finish(ctx);
+}
+
+const esp_http_upload_stage_ops_t esp_http_upload_sparse_ops = {
+    .write = sparse_stage_write,
+    .finish = sparse_stage_finish,
+};
+
+#ifdef CONFIG_HTTPD_FOTA_DECOMPRESS
+//gzip header flags, RFC1952
+#define GZIP_FHCRC 0x02
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+#define INFLATE_TRAILER_SIZE 8 //CRC32 and ISIZE
+#define INFLATE_LOOKAHEAD 8    //bytes decompressor bit buffer may hold past deflate end
+
+esp_err_t esp_http_upload_inflate_init(esp_http_upload_inflate_t *inf, esp_http_upload_flush_t write, void *ctx)
+{
+    memset(inf, 0, sizeof(esp_http_upload_inflate_t));
+    inf->tinfl = malloc(sizeof(tinfl_decompressor));
+    inf->window = malloc(INFLATE_WINDOW_SIZE);
+    if (!inf->tinfl || !inf->window) {
+        esp_http_upload_inflate_free(inf);
+        return ESP_ERR_NO_MEM;
+    }
+    tinfl_init(inf->tinfl);
+    inf->state = ESP_HTTP_INFLATE_HEADER;
+    inf->hdr_need = 10;
+    inf->write = write;
+    inf->ctx = ctx;
+    return ESP_OK;
+}
+
+void esp_http_upload_inflate_free(esp_http_upload_inflate_t *inf)
+{
+    free(inf->tinfl);
+    free(inf->window);
+    inf->tinfl = NULL;
+    inf->window = NULL;
+}
+
+//next optional header field after state
+static void inflate_next_field(esp_http_upload_inflate_t *inf)
+{
+    switch (inf->state) {
+    case ESP_HTTP_INFLATE_HEADER:
+        if (inf->flags & GZIP_FEXTRA) {
+            inf->state = ESP_HTTP_INFLATE_EXTRA_LEN;
+            inf->hdr_len = 0;
+            inf->hdr_need = 2;
+            break;
+        }
+        //fall through
+    case ESP_HTTP_INFLATE_EXTRA:
+        if (inf->flags & GZIP_FNAME) {
+            inf->state = ESP_HTTP_INFLATE_NAME;
+            break;
+        }
+        //fall through
+    case ESP_HTTP_INFLATE_NAME:
+        if (inf->flags & GZIP_FCOMMENT) {
+            inf->state = ESP_HTTP_INFLATE_COMMENT;
+            break;
+        }
+        //fall through
+    case ESP_HTTP_INFLATE_COMMENT:
+        if (inf->flags & GZIP_FHCRC) {
+            inf->state = ESP_HTTP_INFLATE_HCRC;
+            inf->hdr_len = 0;
+            inf->hdr_need = 2;
+            break;
+        }
+        //fall through
+    default:
+        inf->state = ESP_HTTP_INFLATE_BODY;
+        break;
+    }
+}
+
+//collect fixed size header field, return true when complete
+static bool inflate_collect(esp_http_upload_inflate_t *inf, const uint8_t **data, size_t *len)
+{
+    size_t n = MIN(*len, inf->hdr_need - inf->hdr_len);
+
+    memcpy(inf->hdr + inf->hdr_len, *data, n);
+    inf->hdr_len += n;
+    *data += n;
+    *len -= n;
+    return inf->hdr_len == inf->hdr_need;
+}
+
+static esp_err_t inflate_header(esp_http_upload_inflate_t *inf, const uint8_t **data, size_t *len)
+{
+    const uint8_t *p;
+    size_t n;
+
+    switch (inf->state) {
+    case ESP_HTTP_INFLATE_HEADER:
+        if (!inflate_collect(inf, data, len))
+            return ESP_OK;
+        //ID1 ID2 CM=deflate
+        if (inf->hdr[0] != 0x1f || inf->hdr[1] != 0x8b || inf->hdr[2] != 8) {
+            ESP_LOGE(TAG, "not a gzip stream");
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        inf->flags = inf->hdr[3];
+        break;
+    case ESP_HTTP_INFLATE_EXTRA_LEN:
+        if (!inflate_collect(inf, data, len))
+            return ESP_OK;
+        inf->skip = inf->hdr[0] | inf->hdr[1] << 8;
+        inf->state = ESP_HTTP_INFLATE_EXTRA;
+        return ESP_OK;
+    case ESP_HTTP_INFLATE_EXTRA:
+        n = MIN(*len, inf->skip);
+        inf->skip -= n;
+        *data += n;
+        *len -= n;
+        if (inf->skip > 0)
+            return ESP_OK;
+        break;
+    case ESP_HTTP_INFLATE_NAME:
+    case ESP_HTTP_INFLATE_COMMENT:
+        p = memchr(*data, 0, *len);
+        n = p ? p - *data + 1 : *len;
+        *data += n;
+        *len -= n;
+        if (!p)
+            return ESP_OK;
+        break;
+    case ESP_HTTP_INFLATE_HCRC:
+        if (!inflate_collect(inf, data, len))
+            return ESP_OK;
+        break;
+    default:
+        return ESP_ERR_INVALID_STATE;
+    }
+    inflate_next_field(inf);
+    return ESP_OK;
+}
+
+//keep last bytes of deflate stream and trailer after it
+static void inflate_keep(esp_http_upload_inflate_t *inf, const uint8_t *data, size_t len)
+{
+    size_t keep;
+
+    if (len >= sizeof(inf->tail)) {
+        memcpy(inf->tail, data + len - sizeof(inf->tail), sizeof(inf->tail));
+        inf->tail_len = sizeof(inf->tail);
+        return;
+    }
+    keep = MIN(inf->tail_len, sizeof(inf->tail) - len);
+    memmove(inf->tail, inf->tail + inf->tail_len - keep, keep);
+    memcpy(inf->tail + keep, data, len);
+    inf->tail_len = keep + len;
+}
+
+static esp_err_t inflate_body(esp_http_upload_inflate_t *inf, const uint8_t **data, size_t *len)
+{
+    tinfl_status status;
+    esp_err_t rc;
+
+    do {
+        size_t in_len = *len;
+        size_t out_len = INFLATE_WINDOW_SIZE - inf->out;
+
+        status = tinfl_decompress(inf->tinfl, *data, &in_len, inf->window, inf->window + inf->out, &out_len,
+                                  TINFL_FLAG_HAS_MORE_INPUT);
+        inflate_keep(inf, *data, in_len);
+        *data += in_len;
+        *len -= in_len;
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "inflate error %d", status);
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+
+        if (out_len > 0) {
+            inf->crc = esp_rom_crc32_le(inf->crc, inf->window + inf->out, out_len);
+            inf->size += out_len;
+            rc = inf->write(inf->ctx, (const char *)inf->window + inf->out, out_len);
+            if (rc != ESP_OK)
+                return rc;
+            inf->out = (inf->out + out_len) & (INFLATE_WINDOW_SIZE - 1);
+        }
+    } while (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+
+    //input not consumed by decompressor stays in data and is collected as trailer
+    if (status == TINFL_STATUS_DONE) {
+        inf->trailer_len = 0;
+        inf->state = ESP_HTTP_INFLATE_TRAILER;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_inflate_write(esp_http_upload_inflate_t *inf, const char *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t n;
+    esp_err_t rc;
+
+    while (len > 0) {
+        switch (inf->state) {
+        case ESP_HTTP_INFLATE_BODY:
+            rc = inflate_body(inf, &p, &len);
+            break;
+        case ESP_HTTP_INFLATE_TRAILER:
+            n = MIN(len, INFLATE_TRAILER_SIZE - inf->trailer_len);
+            inflate_keep(inf, p, n);
+            inf->trailer_len += n;
+            p += n;
+            len -= n;
+            if (inf->trailer_len == INFLATE_TRAILER_SIZE)
+                inf->state = ESP_HTTP_INFLATE_DONE;
+            rc = ESP_OK;
+            break;
+        case ESP_HTTP_INFLATE_DONE:
+            //trailing data ignored, as gzip does for padding
+            return ESP_OK;
+        default:
+            rc = inflate_header(inf, &p, &len);
+            break;
+        }
+        if (rc != ESP_OK)
+            return rc;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_inflate_finish(esp_http_upload_inflate_t *inf)
+{
+    const uint8_t *trailer = NULL;
+    size_t end, k;
+
+    if (inf->state != ESP_HTTP_INFLATE_TRAILER && inf->state != ESP_HTTP_INFLATE_DONE) {
+        ESP_LOGE(TAG, "gzip stream truncated, %u bytes decompressed", inf->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    /* Deflate end is not byte aligned and decompressor may have consumed up
+       to INFLATE_LOOKAHEAD trailer bytes ahead into its bit buffer, so trailer
+       starts somewhere in that many bytes before the unconsumed input. */
+    end = inf->tail_len - inf->trailer_len;
+    for (k = 0; k <= MIN(end, INFLATE_LOOKAHEAD); k++) {
+        const uint8_t *p = inf->tail + end - k;
+        if (end - k + INFLATE_TRAILER_SIZE > inf->tail_len)
+            continue;
+        if (!trailer)
+            trailer = p;
+        if (get_le32(p) == inf->crc && get_le32(p + 4) == (uint32_t)inf->size)
+            return ESP_OK;
+    }
+
+    if (!trailer) {
+        ESP_LOGE(TAG, "gzip stream truncated, %u bytes decompressed", inf->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    ESP_LOGE(TAG, "gzip trailer mismatch, crc %08" PRIx32 "/%08" PRIx32 " size %" PRIu32 "/%u", get_le32(trailer), inf->crc,
+             get_le32(trailer + 4), inf->size);
+    return ESP_ERR_INVALID_CRC;
+}
+
+static esp_err_t inflate_stage_write(void *ctx, const char *data, size_t len)
+{
+    return esp_http_upload_inflate_write(ctx, data, len);
+}
+
+static esp_err_t inflate_stage_finish(void *ctx)
+{
+    return esp_http_upload_inflate_finish(ctx);
+}
+
+static void inflate_stage_free(void *ctx)
+{
+    esp_http_upload_inflate_free(ctx);
+}
+
+const esp_http_upload_stage_ops_t esp_http_upload_inflate_ops = {
+    .write = inflate_stage_write,
+    .finish = inflate_stage_finish,
+    .free = inflate_stage_free,
+};
+#endif
+
+#ifdef CONFIG_HTTPD_FOTA_DELTA
+esp_err_t esp_http_upload_patch_init(esp_http_upload_patch_t *patch, const esp_partition_t *base,
+                                     esp_http_upload_flush_t write, void *ctx)
+{
+    esp_err_t rc;
+
+    memset(patch, 0, sizeof(esp_http_upload_patch_t));
+    rc = esp_partition_get_sha256(base, patch->base_sha256);
+    if (rc != ESP_OK) {
+        ESP_LOGE(TAG, "base partition %s hash error: err=0x%x", base->label, rc);
+        return rc;
+    }
+    patch->buf = malloc(PATCH_BUF_LEN);
+    if (!patch->buf)
+        return ESP_ERR_NO_MEM;
+
+    patch->state = ESP_HTTP_PATCH_HEADER;
+    patch->hdr_need = PATCH_HEADER_LEN;
+    patch->base = base;
+    patch->write = write;
+    patch->ctx = ctx;
+    return ESP_OK;
+}
+
+void esp_http_upload_patch_free(esp_http_upload_patch_t *patch)
+{
+    free(patch->buf);
+    patch->buf = NULL;
+}
+
+//bsdiff offtin, sign and magnitude
+static int64_t get_offtin(const uint8_t *p)
+{
+    int64_t y = p[7] & 0x7f;
+
+    for (int i = 6; i >= 0; i--)
+        y = y << 8 | p[i];
+    return (p[7] & 0x80) ? -y : y;
+}
+
+static esp_err_t patch_parse_header(esp_http_upload_patch_t *patch)
+{
+    const uint8_t *h = patch->hdr;
+
+    if (memcmp(h, PATCH_MAGIC, sizeof(PATCH_MAGIC) - 1) != 0) {
+        ESP_LOGE(TAG, "bad patch magic");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    if (memcmp(h + 8, patch->base_sha256, sizeof(patch->base_sha256)) != 0) {
+        ESP_LOGE(TAG, "patch built for another base image");
+        return ESP_ERR_INVALID_VERSION;
+    }
+    patch->new_size = get_le32(h + 40);
+    patch->state = ESP_HTTP_PATCH_CONTROL;
+    ESP_LOGI(TAG, "patch for %s, new image %u bytes", patch->base->label, patch->new_size);
+    return ESP_OK;
+}
+
+//next record or end of patch
+static void patch_next_record(esp_http_upload_patch_t *patch)
+{
+    patch->hdr_len = 0;
+    patch->hdr_need = 24;
+    patch->state = patch->size < patch->new_size ? ESP_HTTP_PATCH_CONTROL : ESP_HTTP_PATCH_DONE;
+}
+
+//extra bytes done, move base position
+static esp_err_t patch_seek(esp_http_upload_patch_t *patch)
+{
+    int64_t pos = (int64_t)patch->base_pos + patch->seek;
+
+    if (pos < 0 || pos > patch->base->size) {
+        ESP_LOGE(TAG, "patch seek out of base partition");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    patch->base_pos = pos;
+    patch_next_record(patch);
+    return ESP_OK;
+}
+
+static esp_err_t patch_parse_control(esp_http_upload_patch_t *patch)
+{
+    int64_t diff = get_offtin(patch->hdr);
+    int64_t extra = get_offtin(patch->hdr + 8);
+
+    if (diff < 0 || extra < 0 || diff + extra > patch->new_size - patch->size) {
+        ESP_LOGE(TAG, "bad patch record at %u", patch->size);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    patch->remaining = diff;
+    patch->extra_len = extra;
+    patch->seek = get_offtin(patch->hdr + 16);
+    patch->state = ESP_HTTP_PATCH_DIFF;
+    return ESP_OK;
+}
+
+//add diff bytes to base image
+static esp_err_t patch_diff(esp_http_upload_patch_t *patch, const uint8_t *data, size_t len)
+{
+    esp_err_t rc;
+
+    while (len > 0) {
+        size_t n = MIN(len, PATCH_BUF_LEN);
+
+        rc = esp_partition_read(patch->base, patch->base_pos, patch->buf, n);
+        if (rc != ESP_OK) {
+            ESP_LOGE(TAG, "base read error at %u: err=0x%x", patch->base_pos, rc);
+            return rc;
+        }
+        for (size_t i = 0; i < n; i++)
+            patch->buf[i] += data[i];
+
+        rc = patch->write(patch->ctx, (const char *)patch->buf, n);
+        if (rc != ESP_OK)
+            return rc;
+        patch->base_pos += n;
+        patch->size += n;
+        data += n;
+        len -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_patch_write(esp_http_upload_patch_t *patch, const char *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t n;
+    esp_err_t rc;
+
+    while (len > 0 || patch->state == ESP_HTTP_PATCH_DIFF || patch->state == ESP_HTTP_PATCH_EXTRA) {
+        switch (patch->state) {
+        case ESP_HTTP_PATCH_HEADER:
+        case ESP_HTTP_PATCH_CONTROL:
+            n = MIN(len, patch->hdr_need - patch->hdr_len);
+            memcpy(patch->hdr + patch->hdr_len, p, n);
+            patch->hdr_len += n;
+            p += n;
+            len -= n;
+            if (patch->hdr_len < patch->hdr_need)
+                return ESP_OK;
+
+            if (patch->state == ESP_HTTP_PATCH_HEADER) {
+                rc = patch_parse_header(patch);
+                if (rc == ESP_OK)
+                    patch_next_record(patch);
+            } else {
+                rc = patch_parse_control(patch);
+            }
+            if (rc != ESP_OK)
+                return rc;
+            break;
+        case ESP_HTTP_PATCH_DIFF:
+            if (patch->remaining == 0) {
+                patch->remaining = patch->extra_len;
+                patch->state = ESP_HTTP_PATCH_EXTRA;
+                break;
+            }
+            if (len == 0)
+                return ESP_OK;
+            n = MIN(len, patch->remaining);
+            rc = patch_diff(patch, p, n);
+            if (rc != ESP_OK)
+                return rc;
+            patch->remaining -= n;
+            p += n;
+            len -= n;
+            break;
+        case ESP_HTTP_PATCH_EXTRA:
+            if (patch->remaining == 0) {
+                rc = patch_seek(patch);
+                if (rc != ESP_OK)
+                    return rc;
+                break;
+            }
+            if (len == 0)
+                return ESP_OK;
+            n = MIN(len, patch->remaining);
+            rc = patch->write(patch->ctx, (const char *)p, n);
+            if (rc != ESP_OK)
+                return rc;
+            patch->size += n;
+            patch->remaining -= n;
+            p += n;
+            len -= n;
+            break;
+        default:
+            //trailing data ignored
+            return ESP_OK;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_patch_finish(esp_http_upload_patch_t *patch)
+{
+    if (patch->state != ESP_HTTP_PATCH_DONE) {
+        ESP_LOGE(TAG, "patch truncated, %u/%u bytes rebuilt", patch->size, patch->new_size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t patch_stage_write(void *ctx, const char *data, size_t len)
+{
+    return esp_http_upload_patch_write(ctx, data, len);
+}
+
+static esp_err_t patch_stage_finish(void *ctx)
+{
+    return esp_http_upload_patch_finish(ctx);
+}
+
+static void patch_stage_free(void *ctx)
+{
+    esp_http_upload_patch_free(ctx);
+}
+
+const esp_http_upload_stage_ops_t esp_http_upload_patch_ops = {
+    .write = patch_stage_write,
+    .finish = patch_stage_finish,
+    .free = patch_stage_free,
+};
+#endif
+
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+#define mbedtls_sha256_starts mbedtls_sha256_starts_ret
+#define mbedtls_sha256_update mbedtls_sha256_update_ret
+#define mbedtls_sha256_finish mbedtls_sha256_finish_ret
+#endif
+
+esp_err_t esp_http_upload_parse_digest(const char *hex, uint8_t digest[UPLOAD_DIGEST_LEN])
+{
+    if (strlen(hex) != 2 * UPLOAD_DIGEST_LEN)
+        return ESP_ERR_INVALID_ARG;
+
+    for (int i = 0; i < UPLOAD_DIGEST_LEN; i++) {
+        if (sscanf(hex + 2 * i, "%2hhx", &digest[i]) != 1)
+            return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_digest_init(esp_http_upload_digest_t *d, httpd_req_t *req)
+{
+    char hex[2 * UPLOAD_DIGEST_LEN + 1];
+
+    memset(d, 0, sizeof(esp_http_upload_digest_t));
+    if (httpd_req_get_hdr_value_str(req, UPLOAD_DIGEST_HEADER, hex, sizeof(hex)) != ESP_OK)
+        return ESP_OK;
+
+    if (esp_http_upload_parse_digest(hex, d->expected) != ESP_OK) {
+        ESP_LOGE(TAG, "bad %s header", UPLOAD_DIGEST_HEADER);
+        return ESP_ERR_INVALID_ARG;
+    }
+    d->has_expected = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_digest_field(esp_http_upload_digest_t *d, esp_http_multipart_t *mp)
+{
+    char hex[2 * UPLOAD_DIGEST_LEN + 1];
+    size_t hex_len = 0;
+    const char *data;
+    int len;
+
+    if (strcmp(mp->part.name, UPLOAD_DIGEST_FIELD) != 0)
+        return ESP_OK;
+
+    while ((len = esp_http_multipart_read(mp, &data)) > 0) {
+        for (int i = 0; i < len; i++) {
+            if (isspace((unsigned char)data[i]))
                 continue;
-            ESP_LOGE(TAG, "httpd_req_recv error: err=0x%d", recv);
-            return -1;
+            if (hex_len == sizeof(hex) - 1)
+                return ESP_ERR_INVALID_ARG;
+            hex[hex_len++] = data[i];
         }
-        bytes_read += recv;
-        bytes_left -= recv;
     }
-    /* Finally we should get something like:
-	boundary:-----------------------------371500130728362684651932529351
-	buf: CRLF-----------------------------371500130728362684651932529351--*/
-    if (strncmp(buf + 2, boundary, boundary_len - 2) != 0) {
-        ESP_LOGE(TAG, "final boundary not found");
-        return -1;
+    if (len < 0)
+        return ESP_FAIL;
+    hex[hex_len] = '\0';
+
+    if (esp_http_upload_parse_digest(hex, d->expected) != ESP_OK) {
+        ESP_LOGE(TAG, "bad %s field", UPLOAD_DIGEST_FIELD);
+        return ESP_ERR_INVALID_ARG;
     }
-    return bytes_read;
+    d->has_expected = true;
+    return esp_http_multipart_next_part(mp);
 }
 
-esp_err_t esp_http_upload_json_status(httpd_req_t *req, esp_err_t rc, int uploaded)
+void esp_http_upload_digest_start(esp_http_upload_digest_t *d)
 {
+    mbedtls_sha256_init(&d->ctx);
+    mbedtls_sha256_starts(&d->ctx, 0);
+}
+
+void esp_http_upload_digest_update(esp_http_upload_digest_t *d, const char *data, size_t len)
+{
+    mbedtls_sha256_update(&d->ctx, (const unsigned char *)data, len);
+}
+
+esp_err_t esp_http_upload_digest_finish(esp_http_upload_digest_t *d)
+{
+    mbedtls_sha256_finish(&d->ctx, d->digest);
+    mbedtls_sha256_free(&d->ctx);
+
+    if (d->has_expected && memcmp(d->digest, d->expected, UPLOAD_DIGEST_LEN) != 0) {
+        ESP_LOGE(TAG, "payload SHA-256 mismatch");
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_upload_pipeline_begin(esp_http_upload_pipeline_t *pl, httpd_req_t *req,
+                                         esp_http_upload_stats_t *stats)
+{
+    esp_err_t rc;
+
+    CHECK_ARG(pl);
+    CHECK_ARG(stats);
+
+    memset(pl, 0, sizeof(esp_http_upload_pipeline_t));
+    pl->stats = stats;
+
+    rc = esp_http_multipart_begin(&pl->mp, req);
+    if (rc != ESP_OK)
+        return rc;
+
+    rc = esp_http_multipart_next_part(&pl->mp);
+    if (rc == ESP_OK)
+        rc = esp_http_upload_digest_init(&pl->digest, req);
+    if (rc == ESP_OK)
+        rc = esp_http_upload_digest_field(&pl->digest, &pl->mp);
+    if (rc != ESP_OK) {
+        if (rc == ESP_ERR_NOT_FOUND)
+            ESP_LOGE(TAG, "no file uploaded");
+        esp_http_multipart_end(&pl->mp);
+    }
+    return rc;
+}
+
+esp_err_t esp_http_upload_pipeline_add(esp_http_upload_pipeline_t *pl, const esp_http_upload_stage_ops_t *ops,
+                                       void *ctx)
+{
+    CHECK_ARG(pl);
+    CHECK_ARG(ops && ops->write);
+
+    if (pl->stages_len == UPLOAD_PIPELINE_MAX_STAGES)
+        return ESP_ERR_NO_MEM;
+    pl->stages[pl->stages_len].ops = ops;
+    pl->stages[pl->stages_len].ctx = ctx;
+    pl->stages_len++;
+    return ESP_OK;
+}
+
+//release stages of finished part, request stays open
+static void pipeline_free_stages(esp_http_upload_pipeline_t *pl)
+{
+    while (pl->stages_len > 0) {
+        esp_http_upload_stage_t *st = &pl->stages[--pl->stages_len];
+        if (st->ops->free)
+            st->ops->free(st->ctx);
+    }
+}
+
+esp_err_t esp_http_upload_pipeline_run_part(esp_http_upload_pipeline_t *pl)
+{
+    esp_http_upload_stage_t *head;
+    esp_err_t rc = ESP_OK;
+    const char *data;
+    int len;
+
+    CHECK_ARG(pl && pl->stages_len);
+
+    head = &pl->stages[pl->stages_len - 1];
+    esp_http_upload_digest_start(&pl->digest);
+    while ((len = esp_http_multipart_read(&pl->mp, &data)) > 0) {
+        esp_http_upload_digest_update(&pl->digest, data, len);
+        rc = head->ops->write(head->ctx, data, len);
+        if (rc != ESP_OK)
+            break;
+        pl->stats->bytes_uploaded += len;
+        ESP_LOGD(TAG, "%s: %u bytes", pl->mp.part.name, pl->stats->bytes_uploaded);
+    }
+    pl->dropped = len < 0;
+
+    //refuse file which is not the one client sent
+    if (esp_http_upload_digest_finish(&pl->digest) != ESP_OK && rc == ESP_OK && len == 0)
+        rc = ESP_ERR_INVALID_CRC;
+    if (len == 0)
+        pl->stats->sha256 = pl->digest.digest;
+
+    //finishing stage may still write to the next one
+    for (size_t i = pl->stages_len; i-- > 0 && rc == ESP_OK && len == 0;) {
+        if (pl->stages[i].ops->finish)
+            rc = pl->stages[i].ops->finish(pl->stages[i].ctx);
+    }
+    pipeline_free_stages(pl);
+
+    if (rc == ESP_OK && pl->dropped)
+        rc = ESP_FAIL;
+    return rc;
+}
+
+esp_err_t esp_http_upload_pipeline_run(esp_http_upload_pipeline_t *pl)
+{
+    esp_err_t rc = esp_http_upload_pipeline_run_part(pl);
+    esp_http_upload_pipeline_end(pl);
+    return rc;
+}
+
+esp_err_t esp_http_upload_pipeline_next(esp_http_upload_pipeline_t *pl)
+{
+    esp_err_t rc;
+
+    CHECK_ARG(pl);
+
+    //stages of part which was not received
+    pipeline_free_stages(pl);
+    if (pl->dropped)
+        return ESP_FAIL;
+
+    //X-Image-Hash names first file, next ones are checked by their own sha256 field
+    memset(&pl->digest, 0, sizeof(pl->digest));
+    rc = esp_http_multipart_next_part(&pl->mp);
+    if (rc == ESP_OK)
+        rc = esp_http_upload_digest_field(&pl->digest, &pl->mp);
+    return rc;
+}
+
+void esp_http_upload_pipeline_end(esp_http_upload_pipeline_t *pl)
+{
+    if (!pl)
+        return;
+    esp_http_multipart_end(&pl->mp);
+    pipeline_free_stages(pl);
+}
+
+esp_err_t esp_http_upload_json_stats(httpd_req_t *req, esp_err_t rc, const esp_http_upload_stats_t *stats)
+{
+    esp_httpd_json_t jw;
     char buf[32];
-    sprintf(buf, "%d", uploaded);
+    sprintf(buf, "%u", stats->bytes_uploaded);
+
+    esp_httpd_json_begin(&jw, req);
+    esp_httpd_json_string(&jw, "result", esp_err_to_name(rc));
+    esp_httpd_json_string(&jw, "bytes_uploaded", buf);
+    if (stats->bytes_decompressed) {
+        sprintf(buf, "%u", stats->bytes_decompressed);
+        esp_httpd_json_string(&jw, "bytes_decompressed", buf);
+    }
+    if (stats->sectors_written || stats->sectors_skipped) {
+        esp_httpd_json_int(&jw, "sectors_written", stats->sectors_written);
+        esp_httpd_json_int(&jw, "sectors_skipped", stats->sectors_skipped);
+    }
+    if (stats->sha256) {
+        char hex[2 * UPLOAD_DIGEST_LEN + 1];
+        for (int i = 0; i < UPLOAD_DIGEST_LEN; i++)
+            sprintf(hex + 2 * i, "%02x", stats->sha256[i]);
+        esp_httpd_json_string(&jw, "sha256", hex);
+    }
+    return esp_httpd_json_end(&jw);
+}
 
-    cJSON *js = cJSON_CreateObject();
-    cJSON_AddStringToObject(js, "result", esp_err_to_name(rc));
-    cJSON_AddStringToObject(js, "bytes_uploaded", buf);
+esp_err_t esp_http_upload_json_status(httpd_req_t *req, esp_err_t rc, int uploaded)
+{
+    esp_http_upload_stats_t stats = { .bytes_uploaded = uploaded };
+    return esp_http_upload_json_stats(req, rc, &stats);
+}
+
+esp_err_t esp_http_upload_abort(httpd_req_t *req, esp_err_t rc, const esp_http_upload_stats_t *stats)
+{
+    httpd_resp_set_hdr(req, "Connection", "close");
+    esp_http_upload_json_stats(req, rc, stats);
+    return ESP_FAIL;
+}
+
+static bool etag_match(const char *tag, size_t len, const uint8_t digest[UPLOAD_DIGEST_LEN])
+{
+    uint8_t value[UPLOAD_DIGEST_LEN];
+    char hex[2 * UPLOAD_DIGEST_LEN + 1];
+
+    if (len > 2 && tag[0] == 'W' && tag[1] == '/') {
+        tag += 2;
+        len -= 2;
+    }
+    if (len >= 2 && tag[0] == '"' && tag[len - 1] == '"') {
+        tag++;
+        len -= 2;
+    }
+    if (len != 2 * UPLOAD_DIGEST_LEN)
+        return false;
+
+    memcpy(hex, tag, len);
+    hex[len] = '\0';
+    return esp_http_upload_parse_digest(hex, value) == ESP_OK && memcmp(value, digest, UPLOAD_DIGEST_LEN) == 0;
+}
+
+esp_err_t esp_http_upload_match_partition(httpd_req_t *req, const esp_partition_t *part,
+                                          uint8_t digest[UPLOAD_DIGEST_LEN])
+{
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    char *hdr, *tag, *end;
+
+    size_t hdr_len = httpd_req_get_hdr_value_len(req, "If-None-Match");
+    if (!hdr_len || !part)
+        return ESP_ERR_NOT_FOUND;
+
+    hdr = malloc(hdr_len + 1);
+    if (!hdr)
+        return ESP_ERR_NO_MEM;
+    httpd_req_get_hdr_value_str(req, "If-None-Match", hdr, hdr_len + 1);
+
+    err = esp_partition_get_sha256(part, digest);
+    if (err != ESP_OK) {
+        //no valid image, nothing to match
+        free(hdr);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    err = ESP_ERR_NOT_FOUND;
+    for (tag = hdr; *tag && err != ESP_OK; tag = *end ? end + 1 : end) {
+        while (*tag == ' ' || *tag == '\t')
+            tag++;
+        end = strchr(tag, ',');
+        if (!end)
+            end = tag + strlen(tag);
+
+        size_t len = end - tag;
+        while (len && (tag[len - 1] == ' ' || tag[len - 1] == '\t'))
+            len--;
+        if (etag_match(tag, len, digest))
+            err = ESP_OK;
+    }
+    free(hdr);
+
+    if (err == ESP_OK)
+        ESP_LOGI(TAG, "partition %s content matches If-None-Match", part->label);
+    return err;
+}
+
+esp_err_t esp_http_upload_not_modified(httpd_req_t *req, const uint8_t digest[UPLOAD_DIGEST_LEN])
+{
+    char etag[2 * UPLOAD_DIGEST_LEN + 3];
+
+    etag[0] = '"';
+    for (int i = 0; i < UPLOAD_DIGEST_LEN; i++)
+        sprintf(etag + 1 + 2 * i, "%02x", digest[i]);
+    strcpy(etag + 1 + 2 * UPLOAD_DIGEST_LEN, "\"");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_status(req, "304 Not Modified");
+    httpd_resp_set_hdr(req, "Connection", "close");
+    httpd_resp_send(req, NULL, 0);
+    return ESP_FAIL;
+}
 
-    return esp_httpd_resp_json(req, js);
+#if CONFIG_IDF_TARGET_ESP8266
+#define UPLOAD_ENTER_CRITICAL() taskENTER_CRITICAL()
+#define UPLOAD_EXIT_CRITICAL() taskEXIT_CRITICAL()
+#else
+static portMUX_TYPE upload_mux = portMUX_INITIALIZER_UNLOCKED;
+#define UPLOAD_ENTER_CRITICAL() taskENTER_CRITICAL(&upload_mux)
+#define UPLOAD_EXIT_CRITICAL() taskEXIT_CRITICAL(&upload_mux)
+#endif
+
+static esp_http_upload_ticket_t *upload_tickets; //admitted uploads
+static size_t upload_reserved;                   //heap reserved by admitted uploads
+static uint32_t upload_refused;
+
+static bool upload_conflict(const esp_http_upload_ticket_t *a, const esp_http_upload_ticket_t *b)
+{
+    if (a->shared && b->shared)
+        return false;
+    if (a->part == b->part)
+        return true;
+    //SPIFFS files live in one of SPIFFS partitions
+    const esp_partition_t *part = a->part ? a->part : b->part;
+    return (!a->part || !b->part) && part->subtype == ESP_PARTITION_SUBTYPE_DATA_SPIFFS;
+}
+
+esp_err_t esp_http_upload_admit(httpd_req_t *req, esp_http_upload_ticket_t *t)
+{
+    esp_err_t rc = ESP_OK;
+
+    CHECK_ARG(req && t);
+
+    if (!t->part)
+        t->shared = true;
+    snprintf(t->uri, sizeof(t->uri), "%s", req->uri);
+    //heap allocator takes its own lock, sample it outside of critical section
+    size_t free_heap = esp_get_free_heap_size();
+
+    UPLOAD_ENTER_CRITICAL();
+    for (esp_http_upload_ticket_t *it = upload_tickets; it && rc == ESP_OK; it = it->next) {
+        if (upload_conflict(it, t))
+            rc = ESP_ERR_INVALID_STATE;
+    }
+    if (rc == ESP_OK && upload_tickets && upload_reserved + t->heap > CONFIG_HTTPD_UPLOAD_HEAP_BUDGET)
+        rc = ESP_ERR_NO_MEM;
+    if (rc == ESP_OK && free_heap < t->heap + CONFIG_HTTPD_UPLOAD_MIN_FREE_HEAP)
+        rc = ESP_ERR_NO_MEM;
+    if (rc == ESP_OK) {
+        t->next = upload_tickets;
+        upload_tickets = t;
+        upload_reserved += t->heap;
+    } else {
+        upload_refused++;
+    }
+    UPLOAD_EXIT_CRITICAL();
+
+    if (rc != ESP_OK)
+        ESP_LOGW(TAG, "%s refused: %s", req->uri, rc == ESP_ERR_INVALID_STATE ? "partition busy" : "out of heap");
+    return rc;
+}
+
+void esp_http_upload_release(esp_http_upload_ticket_t *t)
+{
+    if (!t)
+        return;
+
+    UPLOAD_ENTER_CRITICAL();
+    for (esp_http_upload_ticket_t **it = &upload_tickets; *it; it = &(*it)->next) {
+        if (*it == t) {
+            *it = t->next;
+            upload_reserved -= t->heap;
+            break;
+        }
+    }
+    UPLOAD_EXIT_CRITICAL();
+}
+
+esp_err_t esp_http_upload_busy(httpd_req_t *req, esp_err_t rc)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_set_hdr(req, "Retry-After", UPLOAD_RETRY_AFTER);
+    return esp_http_upload_abort(req, rc, &(esp_http_upload_stats_t){ 0 });
+}
+
+esp_err_t esp_httpd_upload_admission_handler(httpd_req_t *req)
+{
+    esp_http_upload_ticket_t list[UPLOAD_STATUS_MAX];
+    size_t list_len = 0;
+    size_t reserved;
+    uint32_t refused;
+
+    //copy state, no allocation in critical section
+    UPLOAD_ENTER_CRITICAL();
+    for (esp_http_upload_ticket_t *it = upload_tickets; it && list_len < UPLOAD_STATUS_MAX; it = it->next)
+        list[list_len++] = *it;
+    reserved = upload_reserved;
+    refused = upload_refused;
+    UPLOAD_EXIT_CRITICAL();
+
+    esp_httpd_json_t jw;
+    esp_httpd_json_begin(&jw, req);
+    esp_httpd_json_int(&jw, "heap_budget", CONFIG_HTTPD_UPLOAD_HEAP_BUDGET);
+    esp_httpd_json_int(&jw, "heap_reserved", reserved);
+    esp_httpd_json_int(&jw, "free_heap", esp_get_free_heap_size());
+    esp_httpd_json_int(&jw, "min_free_heap", CONFIG_HTTPD_UPLOAD_MIN_FREE_HEAP);
+    esp_httpd_json_int(&jw, "refused", refused);
+
+    esp_httpd_json_array(&jw, "uploads");
+    for (size_t i = 0; i < list_len; i++) {
+        esp_httpd_json_object(&jw, NULL);
+        esp_httpd_json_string(&jw, "uri", list[i].uri);
+        esp_httpd_json_string(&jw, "partition", list[i].part ? list[i].part->label : "files");
+        esp_httpd_json_int(&jw, "heap", list[i].heap);
+        esp_httpd_json_bool(&jw, "shared", list[i].shared);
+        esp_httpd_json_close(&jw);
+    }
+    return esp_httpd_json_end(&jw);
 }
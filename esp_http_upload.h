@@ -7,16 +7,23 @@
 #ifndef _HTTPD_SERVER_UPLOAD_H_
 #define _HTTPD_SERVER_UPLOAD_H_
 
+#include <sdkconfig.h>
 #include <esp_err.h>
 #include <esp_http_server.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define UPLOAD_BUF_LEN 2048
+#define UPLOAD_BUF_LEN CONFIG_HTTPD_UPLOAD_BUF_LEN
 #define BOUNDARY_LEN 70 //as described in RFC1341
 
+#ifndef SPI_FLASH_SEC_SIZE
+#define SPI_FLASH_SEC_SIZE 4096
+#endif
+
 /**
  * @brief Find boundary string in request header
  *
@@ -28,34 +35,646 @@ extern "C" {
  */
 esp_err_t esp_http_get_boundary(httpd_req_t *req, char *boundary);
 
+typedef enum {
+    ESP_HTTP_MULTIPART_PREAMBLE = 0, //before initial boundary
+    ESP_HTTP_MULTIPART_DELIMITER,    //boundary consumed, CRLF or final "--" expected
+    ESP_HTTP_MULTIPART_HEADERS,      //part headers until CRLF CRLF
+    ESP_HTTP_MULTIPART_BODY,         //part body until next boundary
+    ESP_HTTP_MULTIPART_DONE,         //final boundary found
+} esp_http_multipart_state_t;
+
+typedef struct {
+    char name[32];         //Content-Disposition name parameter
+    char filename[64];     //Content-Disposition filename parameter
+    char content_type[48]; //part Content-Type
+    char encoding[16];     //part Content-Encoding
+} esp_http_multipart_part_t;
+
 /**
- * @brief Find initial boundary string in request body
+ * @brief Incremental multipart/form-data parser
+ *
+ * Request data is received block by block into a single buffer, part headers
+ * are parsed from that buffer and part body is handed out as slices pointing
+ * into it, so no extra copy or per byte recv call is needed.
  *
+ * Part end is found by scanning for CRLF + boundary with Horspool algorithm,
+ * skip table is built once from boundary string. Only bytes which may be
+ * a beginning of delimiter split between two blocks are held back, so
+ * Content-Length, preamble and epilogue do not affect body detection.
+ *
+ * Request with other than multipart Content-Type, e.g. application/octet-stream,
+ * is handled as a single part named "file" whose body is the whole request
+ * body. Part filename, content type and encoding are taken from request
+ * Content-Disposition, Content-Type and Content-Encoding headers, received
+ * blocks are handed out without any scanning.
+ */
+typedef struct {
+    httpd_req_t *req;
+    esp_http_multipart_state_t state;
+    char delim[BOUNDARY_LEN + 2]; //CRLF + boundary
+    size_t delim_len;
+    uint8_t skip[256]; //Horspool bad character shift table for delim
+    char *buf;
+    size_t buf_size;
+    size_t head;       //first unconsumed byte in buf
+    size_t tail;       //end of received data in buf
+    size_t bytes_left; //request bytes not received yet
+    bool raw;          //body without multipart framing
+    esp_http_multipart_part_t part;
+} esp_http_multipart_t;
+
+/**
+ * @brief Start multipart request parsing
+ *
+ * @mp Parser to initialize
  * @req The request being responded to
- * @boundary Pointer to boundary string
- * @bytes_left Request bytes left
- * @return bytes read, or -1 if not found
+ *
+ * @return
+ *  - ESP_OK : Parser ready, esp_http_multipart_end() has to be called when done
+ *  - ESP_ERR_NOT_FOUND : No Content-Type in request header
+ *  - ESP_ERR_INVALID_ARG : No boundary in multipart Content-Type
+ *  - ESP_ERR_NOT_SUPPORTED : Request body with Transfer-Encoding, response
+ *    status is set to 411 Length Required and connection is closed after it
+ *  - ESP_ERR_NO_MEM : Buffer cannot be allocated
+ */
+esp_err_t esp_http_multipart_begin(esp_http_multipart_t *mp, httpd_req_t *req);
+
+/**
+ * @brief Move to next part and parse its headers into mp->part
+ *
+ * Unread data of current part is skipped
+ *
+ * @mp Multipart parser
+ *
+ * @return
+ *  - ESP_OK : Part found, body can be read with esp_http_multipart_read()
+ *  - ESP_ERR_NOT_FOUND : No more parts, final boundary reached
+ *  - ESP_ERR_INVALID_RESPONSE : Malformed multipart data
+ *  - ESP_FAIL : Receive error
+ */
+esp_err_t esp_http_multipart_next_part(esp_http_multipart_t *mp);
+
+/**
+ * @brief Read next slice of current part body
+ *
+ * @mp Multipart parser
+ * @data Set to slice start, valid until next parser call
+ *
+ * @return slice length, 0 at the end of part or -1 on error
+ */
+int esp_http_multipart_read(esp_http_multipart_t *mp, const char **data);
+
+/**
+ * @brief Release parser resources
+ *
+ * @mp Multipart parser
+ */
+void esp_http_multipart_end(esp_http_multipart_t *mp);
+
+typedef esp_err_t (*esp_http_upload_flush_t)(void *ctx, const char *data, size_t len);
+
+/**
+ * @brief Upload stage or sink operations, see esp_http_upload_pipeline_t
+ */
+typedef struct {
+    esp_http_upload_flush_t write;  //consume data slice
+    esp_err_t (*finish)(void *ctx); //all data written, pass pending output on, may be NULL
+    void (*free)(void *ctx);        //release resources after success or error, may be NULL
+} esp_http_upload_stage_ops_t;
+
+/**
+ * @brief Write coalescing stage
+ *
+ * Collects data slices of any size into blocks of fixed size, so sink gets
+ * fewer and aligned writes. Only last block passed to sink may be shorter.
+ */
+typedef struct {
+    char *buf;
+    size_t size; //block size
+    size_t len;  //bytes pending in buf
+    esp_http_upload_flush_t flush;
+    void *ctx;
+} esp_http_upload_coalesce_t;
+
+/**
+ * @brief Initialize write coalescing stage
+ *
+ * @c Coalescing stage
+ * @size Block size, for flash sinks should be multiple of sector size
+ * @flush Block write function
+ * @ctx Block write function context
+ *
+ * @return ESP_OK or ESP_ERR_NO_MEM if buffer cannot be allocated
+ */
+esp_err_t esp_http_upload_coalesce_init(esp_http_upload_coalesce_t *c, size_t size, esp_http_upload_flush_t flush,
+                                        void *ctx);
+
+/**
+ * @brief Pass data to coalescing stage, full blocks are written to sink
+ *
+ * @c Coalescing stage
+ * @data Data to write
+ * @len Data length
+ *
+ * @return ESP_OK or error returned by sink
+ */
+esp_err_t esp_http_upload_coalesce_write(esp_http_upload_coalesce_t *c, const char *data, size_t len);
+
+/**
+ * @brief Write pending data to sink
+ *
+ * @c Coalescing stage
+ *
+ * @return ESP_OK or error returned by sink
+ */
+esp_err_t esp_http_upload_coalesce_flush(esp_http_upload_coalesce_t *c);
+
+/**
+ * @brief Release coalescing stage buffer, pending data is dropped
+ *
+ * @c Coalescing stage
+ */
+void esp_http_upload_coalesce_free(esp_http_upload_coalesce_t *c);
+
+extern const esp_http_upload_stage_ops_t esp_http_upload_coalesce_ops;
+
+/**
+ * @brief Incremental partition erase state
+ */
+typedef struct {
+    const esp_partition_t *part;
+    size_t erased; //end of sector aligned area ready for writing
+} esp_http_upload_erase_t;
+
+/**
+ * @brief Initialize incremental erase, nothing is erased yet
+ *
+ * @e Erase state
+ * @part Partition to be written
+ */
+void esp_http_upload_erase_init(esp_http_upload_erase_t *e, const esp_partition_t *part);
+
+/**
+ * @brief Make sure sectors covering given range are erased
+ *
+ * Sectors below already erased area are skipped, sectors which read back as
+ * blank are not erased. Consecutive sectors are erased with single call.
+ *
+ * @e Erase state
+ * @offset Range offset in partition
+ * @len Range length
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if range exceeds partition or flash error
+ */
+esp_err_t esp_http_upload_erase_range(esp_http_upload_erase_t *e, size_t offset, size_t len);
+
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+
+typedef esp_err_t (*esp_http_upload_fill_t)(void *ctx, const uint32_t *value, size_t len);
+
+typedef enum {
+    ESP_HTTP_SPARSE_DETECT = 0, //waiting for magic
+    ESP_HTTP_SPARSE_PASSTHROUGH,
+    ESP_HTTP_SPARSE_FILE_HEADER,
+    ESP_HTTP_SPARSE_CHUNK_HEADER,
+    ESP_HTTP_SPARSE_RAW,
+    ESP_HTTP_SPARSE_FILL,
+    ESP_HTTP_SPARSE_SKIP, //unsupported chunk data or extra header bytes
+    ESP_HTTP_SPARSE_DONE,
+} esp_http_sparse_state_t;
+
+/**
+ * @brief Sparse image decoding stage
+ *
+ * Decodes Android sparse image format (as created by img2simg) from data
+ * stream. RAW chunk data is passed to write function, FILL and DONT_CARE
+ * chunks to fill function (value is NULL for DONT_CARE), so sink can skip
+ * erased flash areas.
+ * Data without sparse magic is passed to write function unchanged.
+ */
+typedef struct {
+    esp_http_sparse_state_t state;
+    esp_http_sparse_state_t next; //state after skip
+    uint8_t hdr[28];
+    size_t hdr_len;   //header bytes collected
+    size_t hdr_need;  //header bytes expected
+    size_t remaining; //chunk data bytes left
+    size_t skip;      //bytes to skip before next state
+    size_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t blk_align;
+    uint32_t total_chunks;
+    uint32_t chunks_done;
+    uint32_t fill_value;
+    size_t image_size; //decoded image size
+    esp_http_upload_flush_t write;
+    esp_http_upload_fill_t fill;
+    void *ctx;
+} esp_http_upload_sparse_t;
+
+/**
+ * @brief Initialize sparse image decoding stage
+ *
+ * @sp Sparse decoder
+ * @blk_align Sparse images with block size not aligned to this are rejected
+ * @write Decoded data write function
+ * @fill Fill or skip function
+ * @ctx Write and fill functions context
+ */
+void esp_http_upload_sparse_init(esp_http_upload_sparse_t *sp, uint32_t blk_align, esp_http_upload_flush_t write,
+                                 esp_http_upload_fill_t fill, void *ctx);
+
+/**
+ * @brief Decode next part of data stream
+ *
+ * @sp Sparse decoder
+ * @data Data slice
+ * @len Data length
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_VERSION/ESP_ERR_NOT_SUPPORTED on bad sparse
+ * header or error returned by write and fill functions
+ */
+esp_err_t esp_http_upload_sparse_write(esp_http_upload_sparse_t *sp, const char *data, size_t len);
+
+/**
+ * @brief Check that whole sparse image has been decoded
+ *
+ * @sp Sparse decoder
+ *
+ * @return ESP_OK or ESP_ERR_INVALID_SIZE if sparse image is truncated
+ */
+esp_err_t esp_http_upload_sparse_finish(esp_http_upload_sparse_t *sp);
+
+extern const esp_http_upload_stage_ops_t esp_http_upload_sparse_ops;
+
+#ifdef CONFIG_HTTPD_FOTA_DECOMPRESS
+#define INFLATE_WINDOW_SIZE (1 << CONFIG_HTTPD_FOTA_DECOMPRESS_WINDOW_BITS)
+#define INFLATE_HEAP (11 * 1024 + INFLATE_WINDOW_SIZE) //decompressor state and dictionary
+
+typedef enum {
+    ESP_HTTP_INFLATE_HEADER = 0, //fixed gzip header
+    ESP_HTTP_INFLATE_EXTRA_LEN,  //FEXTRA length
+    ESP_HTTP_INFLATE_EXTRA,      //FEXTRA data
+    ESP_HTTP_INFLATE_NAME,       //zero terminated FNAME
+    ESP_HTTP_INFLATE_COMMENT,    //zero terminated FCOMMENT
+    ESP_HTTP_INFLATE_HCRC,       //FHCRC
+    ESP_HTTP_INFLATE_BODY,       //deflate stream
+    ESP_HTTP_INFLATE_TRAILER,    //CRC32 and ISIZE
+    ESP_HTTP_INFLATE_DONE,
+} esp_http_inflate_state_t;
+
+struct tinfl_decompressor_tag;
+
+/**
+ * @brief Gzip decompression stage
+ *
+ * Inflates gzip stream into a wrapping dictionary of INFLATE_WINDOW_SIZE
+ * bytes, every decompressed slice is passed to write function. Stream must
+ * be compressed with window not larger than dictionary, otherwise
+ * decompressed data is corrupted and trailer CRC check fails.
+ */
+typedef struct {
+    esp_http_inflate_state_t state;
+    struct tinfl_decompressor_tag *tinfl;
+    uint8_t *window;
+    size_t out; //write position in window
+    uint8_t hdr[10];
+    size_t hdr_len;     //header bytes collected
+    size_t hdr_need;    //header bytes expected
+    size_t skip;        //FEXTRA bytes left
+    uint8_t flags;      //gzip header flags
+    uint32_t crc;       //decompressed data CRC32
+    size_t size;        //decompressed bytes
+    uint8_t tail[16];   //last input bytes, deflate end and trailer
+    size_t tail_len;    //bytes kept in tail
+    size_t trailer_len; //tail bytes not consumed by decompressor
+    esp_http_upload_flush_t write;
+    void *ctx;
+} esp_http_upload_inflate_t;
+
+/**
+ * @brief Initialize gzip decompression stage
+ *
+ * @inf Decompressor
+ * @write Decompressed data write function
+ * @ctx Write function context
+ *
+ * @return ESP_OK or ESP_ERR_NO_MEM if dictionary cannot be allocated
+ */
+esp_err_t esp_http_upload_inflate_init(esp_http_upload_inflate_t *inf, esp_http_upload_flush_t write, void *ctx);
+
+/**
+ * @brief Decompress next part of gzip stream
+ *
+ * @inf Decompressor
+ * @data Data slice
+ * @len Data length
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_RESPONSE on bad gzip stream or error
+ * returned by write function
+ */
+esp_err_t esp_http_upload_inflate_write(esp_http_upload_inflate_t *inf, const char *data, size_t len);
+
+/**
+ * @brief Check gzip trailer
+ *
+ * @inf Decompressor
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if stream is truncated or
+ * ESP_ERR_INVALID_CRC on CRC32 or size mismatch
+ */
+esp_err_t esp_http_upload_inflate_finish(esp_http_upload_inflate_t *inf);
+
+/**
+ * @brief Release decompressor buffers
+ *
+ * @inf Decompressor
+ */
+void esp_http_upload_inflate_free(esp_http_upload_inflate_t *inf);
+
+extern const esp_http_upload_stage_ops_t esp_http_upload_inflate_ops;
+#endif
+
+#ifdef CONFIG_HTTPD_FOTA_DELTA
+#define PATCH_MAGIC "ESPDELTA"
+#define PATCH_HEADER_LEN 48
+#define PATCH_BUF_LEN 1024
+
+typedef enum {
+    ESP_HTTP_PATCH_HEADER = 0, //magic, base SHA-256 and new image size
+    ESP_HTTP_PATCH_CONTROL,    //control triple
+    ESP_HTTP_PATCH_DIFF,       //bytes added to base image
+    ESP_HTTP_PATCH_EXTRA,      //bytes copied to new image
+    ESP_HTTP_PATCH_DONE,
+} esp_http_patch_state_t;
+
+/**
+ * @brief Binary patch stage
+ *
+ * Rebuilds new image from base partition and bsdiff patch stream. Patch
+ * starts with header:
+ *  - 8 bytes "ESPDELTA" magic
+ *  - 32 bytes SHA-256 of base image as returned by esp_partition_get_sha256
+ *  - 4 bytes little endian new image size, 4 bytes reserved
+ *
+ * followed by uncompressed bsdiff records: control triple of 8 bytes
+ * signed integers (diff length, extra length, base seek), diff bytes and
+ * extra bytes. Rebuilt image is passed to write function.
+ */
+typedef struct {
+    esp_http_patch_state_t state;
+    const esp_partition_t *base;
+    uint8_t base_sha256[32];
+    uint8_t hdr[PATCH_HEADER_LEN];
+    size_t hdr_len;   //header bytes collected
+    size_t hdr_need;  //header bytes expected
+    size_t remaining; //diff or extra bytes left
+    size_t extra_len; //extra bytes of current record
+    int64_t seek;     //base seek after current record
+    size_t base_pos;  //base image read position
+    size_t new_size;  //new image size from header
+    size_t size;      //new image bytes written
+    uint8_t *buf;     //base read buffer
+    esp_http_upload_flush_t write;
+    void *ctx;
+} esp_http_upload_patch_t;
+
+/**
+ * @brief Initialize binary patch stage
+ *
+ * @patch Patch decoder
+ * @base Partition patch is applied to
+ * @write New image write function
+ * @ctx Write function context
+ *
+ * @return ESP_OK, ESP_ERR_NO_MEM or error returned by esp_partition_get_sha256
+ */
+esp_err_t esp_http_upload_patch_init(esp_http_upload_patch_t *patch, const esp_partition_t *base,
+                                     esp_http_upload_flush_t write, void *ctx);
+
+/**
+ * @brief Apply next part of patch stream
+ *
+ * @patch Patch decoder
+ * @data Data slice
+ * @len Data length
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_VERSION if patch is built for another base
+ * image, ESP_ERR_INVALID_RESPONSE on malformed patch or error returned by
+ * write function
  */
-int esp_http_upload_check_initial_boundary(httpd_req_t *req, char *boundary, size_t bytes_left);
+esp_err_t esp_http_upload_patch_write(esp_http_upload_patch_t *patch, const char *data, size_t len);
 
 /**
- * @brief Find multipart content header end(CRLFCRLF byte sequence)
+ * @brief Check that whole new image has been rebuilt
  *
+ * @patch Patch decoder
+ *
+ * @return ESP_OK or ESP_ERR_INVALID_SIZE if patch is truncated
+ */
+esp_err_t esp_http_upload_patch_finish(esp_http_upload_patch_t *patch);
+
+/**
+ * @brief Release patch decoder buffer
+ *
+ * @patch Patch decoder
+ */
+void esp_http_upload_patch_free(esp_http_upload_patch_t *patch);
+
+extern const esp_http_upload_stage_ops_t esp_http_upload_patch_ops;
+#endif
+
+#define UPLOAD_DIGEST_HEADER "X-Image-Hash"
+#define UPLOAD_DIGEST_FIELD "sha256"
+#define UPLOAD_DIGEST_LEN 32
+
+/**
+ * @brief SHA-256 of uploaded payload, computed while it is received
+ *
+ * Expected digest is given by client as 64 hex digits in X-Image-Hash
+ * header or in "sha256" multipart field sent before the file part.
+ */
+typedef struct {
+    mbedtls_sha256_context ctx;
+    uint8_t expected[UPLOAD_DIGEST_LEN];
+    uint8_t digest[UPLOAD_DIGEST_LEN];
+    bool has_expected; //client sent digest
+} esp_http_upload_digest_t;
+
+/**
+ * @brief Parse hex encoded SHA-256 digest
+ *
+ * @hex 64 hex digits
+ * @digest Output digest
+ *
+ * @return ESP_OK or ESP_ERR_INVALID_ARG
+ */
+esp_err_t esp_http_upload_parse_digest(const char *hex, uint8_t digest[UPLOAD_DIGEST_LEN]);
+
+/**
+ * @brief Initialize payload digest, read expected digest from request header
+ *
+ * @d Digest
  * @req The request being responded to
- * @bytes_left Request bytes left
- * @return bytes read, or -1 if not found
+ *
+ * @return ESP_OK or ESP_ERR_INVALID_ARG if header is malformed
+ */
+esp_err_t esp_http_upload_digest_init(esp_http_upload_digest_t *d, httpd_req_t *req);
+
+/**
+ * @brief Read expected digest from "sha256" field and move to next part
+ *
+ * Does nothing if current part is not the digest field.
+ *
+ * @d Digest
+ * @mp Multipart parser with current part
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_ARG if field is malformed or error
+ * returned by esp_http_multipart_next_part
+ */
+esp_err_t esp_http_upload_digest_field(esp_http_upload_digest_t *d, esp_http_multipart_t *mp);
+
+/**
+ * @brief Start hashing, must be followed by esp_http_upload_digest_finish
+ *
+ * @d Digest
+ */
+void esp_http_upload_digest_start(esp_http_upload_digest_t *d);
+
+/**
+ * @brief Hash next part of payload
+ *
+ * @d Digest
+ * @data Data slice
+ * @len Data length
  */
-int esp_http_upload_find_multipart_header_end(httpd_req_t *req, size_t bytes_left);
+void esp_http_upload_digest_update(esp_http_upload_digest_t *d, const char *data, size_t len);
 
 /**
- * @brief Find final boundary string in request body
+ * @brief Finish hashing and compare with expected digest
+ *
+ * @d Digest
+ *
+ * @return ESP_OK if digests match or no digest was sent, ESP_ERR_INVALID_CRC
+ * otherwise
+ */
+esp_err_t esp_http_upload_digest_finish(esp_http_upload_digest_t *d);
+
+typedef struct {
+    size_t bytes_uploaded;     //payload bytes received
+    size_t bytes_decompressed; //decompressed bytes, compressed upload only
+    size_t sectors_written;    //flash sectors written, differential mode only
+    size_t sectors_skipped;    //flash sectors left unchanged, differential mode only
+    const uint8_t *sha256;     //payload digest, if computed
+} esp_http_upload_stats_t;
+
+#define UPLOAD_PIPELINE_MAX_STAGES 4
+
+typedef struct {
+    const esp_http_upload_stage_ops_t *ops;
+    void *ctx;
+} esp_http_upload_stage_t;
+
+/**
+ * @brief Upload pipeline
+ *
+ * Uploaded file (multipart part or raw body, see esp_http_multipart_t) is
+ * hashed (see esp_http_upload_digest_t) and passed through stages into sink.
+ * Sink is added first. Every next stage is initialized to write into
+ * pipeline built so far (UPLOAD_PIPELINE_WRITE and UPLOAD_PIPELINE_CTX) and
+ * then added, so last added stage receives request data. Any write function
+ * can be a sink, e.g. OTA partition, raw partition, VFS file or application
+ * buffer.
+ *
+ * After all data is received, stages are finished from the first one to
+ * sink, so data held by a stage still reaches the sink.
+ */
+typedef struct {
+    esp_http_multipart_t mp;         //source
+    esp_http_upload_digest_t digest; //uploaded file hash
+    esp_http_upload_stage_t stages[UPLOAD_PIPELINE_MAX_STAGES]; //stages[0] is sink
+    size_t stages_len;
+    esp_http_upload_stats_t *stats;
+    bool dropped; //connection lost, file is incomplete
+} esp_http_upload_pipeline_t;
+
+//entry point of pipeline built so far, for initialization of next stage
+#define UPLOAD_PIPELINE_WRITE(PL) ((PL)->stages[(PL)->stages_len - 1].ops->write)
+#define UPLOAD_PIPELINE_CTX(PL) ((PL)->stages[(PL)->stages_len - 1].ctx)
+
+/**
+ * @brief Start upload: parse request up to file data and read expected digest
+ *
+ * On success esp_http_upload_pipeline_run() or esp_http_upload_pipeline_end()
+ * has to be called. File metadata is available in pl->mp.part.
  *
+ * @pl Pipeline
  * @req The request being responded to
- * @boundary Pointer to boundary string
- * @bytes_left Request bytes left
- * @return bytes read, or -1 if not found
+ * @stats Statistics updated by pipeline
+ *
+ * @return ESP_OK, error of esp_http_multipart_begin, ESP_ERR_NOT_FOUND if
+ * request has no file or ESP_ERR_INVALID_ARG on malformed digest
  */
-int esp_http_upload_check_final_boundary(httpd_req_t *req, char *boundary, size_t bytes_left);
+esp_err_t esp_http_upload_pipeline_begin(esp_http_upload_pipeline_t *pl, httpd_req_t *req,
+                                         esp_http_upload_stats_t *stats);
+
+/**
+ * @brief Add stage in front of pipeline
+ *
+ * Stage is released by pipeline when upload or file part ends.
+ *
+ * @pl Pipeline
+ * @ops Stage operations
+ * @ctx Stage context
+ *
+ * @return ESP_OK or ESP_ERR_NO_MEM if there are too many stages
+ */
+esp_err_t esp_http_upload_pipeline_add(esp_http_upload_pipeline_t *pl, const esp_http_upload_stage_ops_t *ops,
+                                       void *ctx);
+
+/**
+ * @brief Receive file, pass it through stages and release pipeline
+ *
+ * @pl Pipeline
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_CRC on digest mismatch, ESP_FAIL if
+ * connection was lost (pl->dropped is set) or error returned by stage
+ */
+esp_err_t esp_http_upload_pipeline_run(esp_http_upload_pipeline_t *pl);
+
+/**
+ * @brief Receive current file part and pass it through stages
+ *
+ * Stages are released, request stays open, so next file part of
+ * multipart request can follow with esp_http_upload_pipeline_next() and
+ * new stages. esp_http_upload_pipeline_end() releases the request.
+ *
+ * @pl Pipeline
+ *
+ * @return Same as esp_http_upload_pipeline_run()
+ */
+esp_err_t esp_http_upload_pipeline_run_part(esp_http_upload_pipeline_t *pl);
+
+/**
+ * @brief Move pipeline to next part of multipart request
+ *
+ * Stages left from previous part are released and unread data of previous
+ * part is skipped. Expected digest of next file is read from "sha256" field
+ * sent before it, X-Image-Hash header applies only to first file.
+ *
+ * @pl Pipeline
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND after last part, ESP_ERR_INVALID_ARG on
+ * malformed digest or ESP_FAIL if connection was lost
+ */
+esp_err_t esp_http_upload_pipeline_next(esp_http_upload_pipeline_t *pl);
+
+/**
+ * @brief Release pipeline without receiving the file, e.g. on setup error
+ *
+ * @pl Pipeline
+ */
+void esp_http_upload_pipeline_end(esp_http_upload_pipeline_t *pl);
 
 /**
  * @brief Return json upload status
@@ -67,6 +686,130 @@ int esp_http_upload_check_final_boundary(httpd_req_t *req, char *boundary, size_
  */
 esp_err_t esp_http_upload_json_status(httpd_req_t *req, esp_err_t rc, int uploaded);
 
+/**
+ * @brief Return json upload status with write statistics
+ *
+ * @req The request being responded to
+ * @rc Upload result code
+ * @stats Upload statistics
+ * @return ESP_OK or ESP_ERR_NO_MEM if json object cannot be created
+ */
+esp_err_t esp_http_upload_json_stats(httpd_req_t *req, esp_err_t rc, const esp_http_upload_stats_t *stats);
+
+/**
+ * @brief Return json upload status and drop rest of request
+ *
+ * Connection is closed after response, so remaining request data is not
+ * received. Handler should return value of this function.
+ *
+ * @req The request being responded to
+ * @rc Upload result code
+ * @stats Upload statistics
+ * @return ESP_FAIL to make HTTPD close the connection
+ */
+esp_err_t esp_http_upload_abort(httpd_req_t *req, esp_err_t rc, const esp_http_upload_stats_t *stats);
+
+/**
+ * @brief Check If-None-Match request header against partition SHA-256
+ *
+ * Header holds one or more comma separated entity tags, quoted or not, each
+ * a 64 hex digits SHA-256 as reported by esp_partition_get_sha256: image
+ * digest for app partitions, digest of whole partition for data partitions.
+ * Call before any request data is received.
+ *
+ * @req The request being responded to
+ * @part Partition to compare with
+ * @digest Output partition digest, valid when partition matches
+ *
+ * @return ESP_OK if partition content matches, ESP_ERR_NOT_FOUND if header is
+ * missing or does not match, ESP_ERR_NO_MEM
+ */
+esp_err_t esp_http_upload_match_partition(httpd_req_t *req, const esp_partition_t *part,
+                                          uint8_t digest[UPLOAD_DIGEST_LEN]);
+
+/**
+ * @brief Respond 304 Not Modified and drop request body
+ *
+ * Connection is closed after response, so upload data the client may
+ * already be sending is not received. Handler should return value of this
+ * function.
+ *
+ * @req The request being responded to
+ * @digest Matching partition digest, sent as ETag
+ * @return ESP_FAIL to make HTTPD close the connection
+ */
+esp_err_t esp_http_upload_not_modified(httpd_req_t *req, const uint8_t digest[UPLOAD_DIGEST_LEN]);
+
+/**
+ * @brief Upload admission ticket
+ *
+ * Handler fills partition it writes, heap its buffers take and sharing mode,
+ * then claims ticket with esp_http_upload_admit() before request body is
+ * received. Exclusive ticket conflicts with any other ticket of the same
+ * partition, shared tickets of one partition may coexist. NULL partition
+ * stands for files of mounted SPIFFS, those are always shared and conflict
+ * with exclusive tickets of SPIFFS partitions.
+ */
+typedef struct esp_http_upload_ticket {
+    const esp_partition_t *part; //written partition, NULL for SPIFFS files
+    size_t heap;                 //heap reserved for upload buffers
+    bool shared;                 //other shared uploads of partition allowed
+    char uri[32];                //request URI, set by esp_http_upload_admit
+    struct esp_http_upload_ticket *next;
+} esp_http_upload_ticket_t;
+
+/**
+ * @brief Admit upload or refuse it before any data is received
+ *
+ * Heap reservations of running uploads are limited by
+ * CONFIG_HTTPD_UPLOAD_HEAP_BUDGET, single upload is admitted regardless of
+ * budget. Free heap must stay above CONFIG_HTTPD_UPLOAD_MIN_FREE_HEAP after
+ * reservation.
+ *
+ * @req The request being responded to
+ * @t Ticket, valid until esp_http_upload_release()
+ *
+ * @return
+ *  - ESP_OK : Upload admitted
+ *  - ESP_ERR_INVALID_STATE : Partition written by another upload
+ *  - ESP_ERR_NO_MEM : Heap budget or free heap threshold exceeded
+ */
+esp_err_t esp_http_upload_admit(httpd_req_t *req, esp_http_upload_ticket_t *t);
+
+/**
+ * @brief Release admitted ticket
+ *
+ * @t Ticket
+ */
+void esp_http_upload_release(esp_http_upload_ticket_t *t);
+
+/**
+ * @brief Respond 503 Service Unavailable with Retry-After and drop request body
+ *
+ * @req The request being responded to
+ * @rc Admission result
+ * @return ESP_FAIL to make HTTPD close the connection
+ */
+esp_err_t esp_http_upload_busy(httpd_req_t *req, esp_err_t rc);
+
+/**
+ * @brief Upload admission state handler, should be configured like:
+ 	httpd_uri_t admission_handler = {
+		.uri       = "/upload/status",
+		.method    = HTTP_GET,
+		.handler   = esp_httpd_upload_admission_handler,
+	}
+
+	Returns heap budget, reserved heap, free heap and its threshold, count of
+	refused uploads and list of running uploads in JSON format.
+ *
+ * @req The request being responded to
+ *
+ * @return
+ *  - ESP_OK : On success
+ */
+esp_err_t esp_httpd_upload_admission_handler(httpd_req_t *req);
+
 #ifdef __cplusplus
 }
 #endif
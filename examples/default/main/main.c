@@ -19,6 +19,7 @@
 #include <esp_http_server_misc.h>
 #include <esp_http_server_fota.h>
 #include <esp_http_server_wifi.h>
+#include <esp_http_upload.h>
 
 #ifndef CONFIG_IDF_TARGET_ESP8266
 #include <esp_mac.h>
@@ -54,17 +55,60 @@ static httpd_uri_t wifi_post_handler = {
     .method = HTTP_POST,
     .handler = esp_httpd_wifi_handler //
 };
+static httpd_uri_t wifi_events_handler = {
+    .uri = "/wifi/events",
+    .method = HTTP_GET,
+    .handler = esp_httpd_wifi_events_handler //
+};
 
 static httpd_uri_t info_handler = {
     .uri = "/info",
     .method = HTTP_GET,
     .handler = esp_httpd_app_info_handler //
 };
+static const esp_httpd_batch_section_t batch_sections[] = {
+    { "wifi", esp_httpd_wifi_info_section },
+    { "wifi_config", esp_httpd_wifi_config_section },
+    { "app", esp_httpd_app_info_section },
+    { NULL },
+};
+static httpd_uri_t batch_handler = {
+    .uri = "/batch",
+    .method = HTTP_GET,
+    .handler = esp_httpd_batch_handler,
+    .user_ctx = (void *)batch_sections //
+};
 static httpd_uri_t fota_handler = {
     .uri = "/update",
     .method = HTTP_POST,
     .handler = esp_httpd_fota_handler //
 };
+static httpd_uri_t upload_status_handler = {
+    .uri = "/upload/status",
+    .method = HTTP_GET,
+    .handler = esp_httpd_upload_admission_handler //
+};
+#ifdef CONFIG_HTTPD_FOTA_RESUME
+static httpd_uri_t fota_status_handler = {
+    .uri = "/update/status",
+    .method = HTTP_GET,
+    .handler = esp_httpd_fota_status_handler //
+};
+#endif
+#ifdef CONFIG_HTTPD_FOTA_RANGED
+static httpd_uri_t fota_ranged_handler = {
+    .uri = "/update/range",
+    .method = HTTP_POST,
+    .handler = esp_httpd_fota_ranged_handler //
+};
+#endif
+#ifdef CONFIG_HTTPD_FOTA_DELTA
+static httpd_uri_t fota_delta_handler = {
+    .uri = "/update/delta",
+    .method = HTTP_POST,
+    .handler = esp_httpd_fota_delta_handler //
+};
+#endif
 
 static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
@@ -158,9 +202,21 @@ static esp_err_t webserver_init(void)
     // CGI - like handlers
     ESP_ERROR_CHECK(httpd_register_uri_handler(server, &wifi_get_handler));
     ESP_ERROR_CHECK(httpd_register_uri_handler(server, &wifi_post_handler));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &wifi_events_handler));
 
     ESP_ERROR_CHECK(httpd_register_uri_handler(server, &info_handler));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &batch_handler));
     ESP_ERROR_CHECK(httpd_register_uri_handler(server, &fota_handler));
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &upload_status_handler));
+#ifdef CONFIG_HTTPD_FOTA_RESUME
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &fota_status_handler));
+#endif
+#ifdef CONFIG_HTTPD_FOTA_RANGED
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &fota_ranged_handler));
+#endif
+#ifdef CONFIG_HTTPD_FOTA_DELTA
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &fota_delta_handler));
+#endif
 
     ESP_LOGI(TAG, "server started on port %d, free mem: %" PRIu32 " bytes", config.server_port, esp_get_free_heap_size());
     return ESP_OK;
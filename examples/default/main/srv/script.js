@@ -7,81 +7,118 @@ function tab(e, id) {
   e.currentTarget.className += " active";
 }
 
+// all documents of first page view in one request
+function pageLoad(){
+	fetch(esp_url+"/batch?include=app,wifi.sta,wifi_config.sta")
+	.then(r => r.json())
+	.then(js => {
+		showAppInfo(js.app);
+		showNetStats(js.wifi.sta);
+		showWiFiConfigForm(js.wifi_config.sta);
+		wifiEvents();
+	});
+}
+
+// station state pushed on change, polling when event stream is not available
+function wifiEvents(){
+	if(!window.EventSource)
+		return setTimeout(netStats, 2000);
+
+	const es = new EventSource(esp_url+"/wifi/events");
+	es.addEventListener("wifi", e => {
+		const js = JSON.parse(e.data);
+		if(js.sta)
+			showNetStats(js.sta);
+	});
+	es.onerror = () => {
+		// refused stream (no free slot) is not retried by browser
+		if(es.readyState === EventSource.CLOSED)
+			setTimeout(netStats, 2000);
+	};
+}
+
 function netStats(){
 	fetch(esp_url+"/wifi")
 	.then(r => r.json())
 	.then(js => {
-		const div = document.getElementById('net');
-		let sta = js.data.sta;
-
-		let stats = `
-			<small>
-				Status: ${sta.status}<br>`;
-		if(sta.connection)
-			stats += `
-				Network: ${sta.connection.ssid}<br>
-				authmode: ${sta.connection.authmode}<br>
-				RSSI: ${sta.connection.rssi} dB<br>`;
-
-		stats +=`
-			IP addr: ${sta.ip_info.ip}<br>
-			netmask: ${sta.ip_info.netmask}<br>
-			gateway: ${sta.ip_info.gw}
-		</small>`;
-
-		div.innerHTML = stats;
+		showNetStats(js.data.sta);
 		return setTimeout(netStats, 2000);
 	});
 }
 
+function showNetStats(sta){
+	const div = document.getElementById('net');
+
+	let stats = `
+		<small>
+			Status: ${sta.status}<br>`;
+	if(sta.connection)
+		stats += `
+			Network: ${sta.connection.ssid}<br>
+			authmode: ${sta.connection.authmode}<br>
+			RSSI: ${sta.connection.rssi} dB<br>`;
+
+	stats +=`
+		IP addr: ${sta.ip_info.ip}<br>
+		netmask: ${sta.ip_info.netmask}<br>
+		gateway: ${sta.ip_info.gw}
+	</small>`;
+
+	div.innerHTML = stats;
+}
+
 function getWiFiConfigForm(){
 	fetch(esp_url+"/wifi?action=get_config")
 	.then(r => r.json())
-	.then(js => {
-		const div = document.getElementById('wifi');
-
-		let html = `
-		<form id="wifi-form" method="post">
-			SSID<br>
-			<input type="text" name="ssid" value="${js.data.sta.ssid}" style="max-width:300px"><br>
-			Password<br>
-			<input type="password" name="passwd" style="max-width:300px"><br>
-			<input type="submit" value="submit">
-		</form>`;
-
-		div.innerHTML = html;
-		const form = document.getElementById('wifi-form');
-		form.onsubmit = function(e){
-			e.preventDefault();
-			let data = decodeURIComponent(new URLSearchParams(new FormData(this)));
-
-			fetch(esp_url+"/wifi?action=connect",
-			{
-				method: "POST",
-				body: data
-			})
-			.then(r => r.json())
-			.then(js => { alert("WiFi config changed"); });
-		};
-	})
+	.then(js => showWiFiConfigForm(js.data.sta));
+}
+
+function showWiFiConfigForm(sta){
+	const div = document.getElementById('wifi');
+
+	let html = `
+	<form id="wifi-form" method="post">
+		SSID<br>
+		<input type="text" name="ssid" value="${sta.ssid}" style="max-width:300px"><br>
+		Password<br>
+		<input type="password" name="passwd" style="max-width:300px"><br>
+		<input type="submit" value="submit">
+	</form>`;
+
+	div.innerHTML = html;
+	const form = document.getElementById('wifi-form');
+	form.onsubmit = function(e){
+		e.preventDefault();
+		let data = decodeURIComponent(new URLSearchParams(new FormData(this)));
+
+		fetch(esp_url+"/wifi?action=connect",
+		{
+			method: "POST",
+			body: data
+		})
+		.then(r => r.json())
+		.then(js => { alert("WiFi config changed"); });
+	};
 }
 
 function appInfo(){
 	fetch(esp_url+"/info")
 	.then(r => r.json())
-	.then(js => {
-		const div = document.getElementById('app');
+	.then(js => showAppInfo(js));
+}
 
-		let info = `
-			<h6>Firmware:</h6>
-			<small>project: ${js.project_name}</small><br>
-			<small>version: ${js.version}</small><br>
-			<small>idf_ver: ${js.idf_ver}</small><br>
-			<small>bulid date: ${js.date}</small><br>
-			<small>bulid time: ${js.time}</small><br>`;
+function showAppInfo(js){
+	const div = document.getElementById('app');
 
-		div.innerHTML = info;
-	});
+	let info = `
+		<h6>Firmware:</h6>
+		<small>project: ${js.project_name}</small><br>
+		<small>version: ${js.version}</small><br>
+		<small>idf_ver: ${js.idf_ver}</small><br>
+		<small>bulid date: ${js.date}</small><br>
+		<small>bulid time: ${js.time}</small><br>`;
+
+	div.innerHTML = info;
 }
 
 function uploadFile(event){
@@ -9,6 +9,7 @@
 
 #include <esp_err.h>
 #include <esp_http_server.h>
+#include "esp_http_server_misc.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,7 +25,7 @@ typedef struct {
 
 /**
  * @brief App info handler. Returns project information from esp_app_desc_t
- * struct in JSON format
+ * struct and running image SHA-256 in JSON format
  *
     httpd_uri_t info_handler = {
         .uri       = "/info",
@@ -39,6 +40,12 @@ typedef struct {
  */
 esp_err_t esp_httpd_app_info_handler(httpd_req_t *req);
 
+/**
+ * @brief esp_httpd_batch_handler() section with esp_httpd_app_info_handler
+ * document
+ */
+void esp_httpd_app_info_section(esp_httpd_json_t *jw, const esp_httpd_batch_t *sel, void *arg);
+
 /**
  * @brief FOTA(Firmware Over The Air) update handler, should be configured like:
  *
@@ -57,6 +64,10 @@ esp_err_t esp_httpd_app_info_handler(httpd_req_t *req);
 		.on_update_complete = on_complete,
 		.arg = "FOTA_ARG"
 	};
+
+	Request with If-None-Match header naming SHA-256 of running image (as
+	reported by app info handler) or of image waiting for reboot is answered
+	with 304 Not Modified without receiving the body.
  *
  * @req The request being responded to
  *
@@ -65,6 +76,59 @@ esp_err_t esp_httpd_app_info_handler(httpd_req_t *req);
  */
 esp_err_t esp_httpd_fota_handler(httpd_req_t *req);
 
+/**
+ * @brief Delta FOTA update handler, configured like esp_httpd_fota_handler.
+ * Uploaded file is a patch created by tools/fota_delta.py against running
+ * firmware image, new image is rebuilt from running partition and patch.
+ * Patches built for another base image are refused.
+ *
+ * Available with CONFIG_HTTPD_FOTA_DELTA.
+ *
+ * @req The request being responded to
+ *
+ * @return
+ *  - ESP_OK : On successful upgrade, error otherwise
+ */
+esp_err_t esp_httpd_fota_delta_handler(httpd_req_t *req);
+
+/**
+ * @brief Resumable FOTA status handler, returns stored upload state in JSON
+ * format: image size, hex SHA-256 and offset the upload continues from.
+ *
+ * With CONFIG_HTTPD_FOTA_RESUME esp_httpd_fota_handler accepts image ranges
+ * sent with headers:
+ *
+	Content-Range: bytes <first>-<last>/<image size>
+	X-Image-Hash: <image SHA-256, 64 hex digits>
+
+	Range starting at 0 begins new upload, next ranges must start at offset
+	returned by this handler or by previous range upload. NVS has to be
+	initialized.
+ *
+ * @req The request being responded to
+ *
+ * @return
+ *  - ESP_OK : On success, error number otherwise
+ */
+esp_err_t esp_httpd_fota_status_handler(httpd_req_t *req);
+
+/**
+ * @brief Ranged FOTA update handler, configured like esp_httpd_fota_handler.
+ * Client splits image into CONFIG_HTTPD_FOTA_RANGE_SIZE aligned ranges and
+ * sends them in any order, possibly over several connections, each request
+ * with Content-Range and X-Image-Hash headers (see
+ * esp_httpd_fota_status_handler). New image is activated when all ranges
+ * are written, see tools/fota_ranged.py.
+ *
+ * Available with CONFIG_HTTPD_FOTA_RANGED.
+ *
+ * @req The request being responded to
+ *
+ * @return
+ *  - ESP_OK : On success, error otherwise
+ */
+esp_err_t esp_httpd_fota_ranged_handler(httpd_req_t *req);
+
 #ifdef __cplusplus
 }
 #endif
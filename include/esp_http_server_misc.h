@@ -7,6 +7,7 @@
 #ifndef _ESP_HTTP_SERVER_MISC_H_
 #define _ESP_HTTP_SERVER_MISC_H_
 
+#include <stdbool.h>
 #include <esp_http_server.h>
 #include <cJSON.h>
 
@@ -45,8 +46,268 @@ extern "C" {
             return ESP_ERR_INVALID_ARG; \
     } while (0)
 
+#define HTTPD_TYPE_CBOR "application/cbor"
+
+/**
+ * @brief Send cJSON tree as response and delete it
+ *
+ * Tree is encoded as JSON or as CBOR when client accepts it, see
+ * esp_httpd_json_begin().
+ *
+ * @req The request being responded to
+ * @js Tree to send, deleted also on error
+ *
+ * @return ESP_OK or error of httpd_resp_send_chunk
+ */
 esp_err_t esp_httpd_resp_json(httpd_req_t *req, cJSON *js);
 
+#define HTTPD_JSON_BUF_LEN 128 //response is sent in chunks of this size
+#define HTTPD_JSON_MAX_DEPTH 31
+
+/**
+ * @brief Streaming JSON response writer
+ *
+ * Response is written member by member into a small buffer flushed with
+ * httpd_resp_send_chunk, no document tree or whole text is kept in heap.
+ * Root object is opened by esp_httpd_json_begin() and everything still open
+ * is closed by esp_httpd_json_end(). Key is NULL for array elements.
+ * Response status and headers must be set before esp_httpd_json_begin().
+ *
+ * When request Accept header lists application/cbor, the same document is
+ * encoded as CBOR (RFC 8949) with indefinite length maps and arrays.
+
+	esp_httpd_json_t jw;
+
+	esp_httpd_json_begin(&jw, req);
+	esp_httpd_json_string(&jw, "result", "ESP_OK");
+	esp_httpd_json_array(&jw, "files");
+	esp_httpd_json_string(&jw, NULL, "index.html");
+	esp_httpd_json_close(&jw);
+	return esp_httpd_json_end(&jw);
+ */
+typedef struct {
+    httpd_req_t *req;
+    esp_err_t err;     //first send error, further output is dropped
+    uint32_t nonempty; //bit per nesting level with members already written
+    uint32_t arrays;   //bit per nesting level which is an array
+    bool cbor;         //encode as CBOR instead of JSON text
+    uint8_t depth;
+    uint8_t len;
+    char buf[HTTPD_JSON_BUF_LEN];
+    char *out; //esp_httpd_json_begin_buf() output, response chunks when NULL
+    size_t out_size;
+    size_t out_len; //document length in out after esp_httpd_json_end()
+} esp_httpd_json_t;
+
+/**
+ * @brief Check whether client asked for CBOR encoded response
+ *
+ * @req The request being responded to
+ *
+ * @return true when Accept header lists application/cbor
+ */
+bool esp_httpd_json_accepts_cbor(httpd_req_t *req);
+
+/**
+ * @brief Start JSON or CBOR response and open root object
+ *
+ * @jw Writer
+ * @req The request being responded to
+ */
+void esp_httpd_json_begin(esp_httpd_json_t *jw, httpd_req_t *req);
+
+/**
+ * @brief Start document written into buffer instead of response
+ *
+ * Encoding is chosen by the request as with esp_httpd_json_begin(), but no
+ * response header is set and nothing is sent. Document length is in
+ * jw->out_len after esp_httpd_json_end().
+ *
+ * @jw Writer
+ * @req The request document is rendered for, NULL for JSON
+ * @buf Output buffer
+ * @size Size of buf
+ */
+void esp_httpd_json_begin_buf(esp_httpd_json_t *jw, httpd_req_t *req, char *buf, size_t size);
+
+/**
+ * @brief Close all open objects and arrays and finish chunked response
+ *
+ * @jw Writer
+ *
+ * @return ESP_OK, error of httpd_resp_send_chunk or ESP_ERR_INVALID_SIZE
+ *         when document does not fit esp_httpd_json_begin_buf() buffer
+ */
+esp_err_t esp_httpd_json_end(esp_httpd_json_t *jw);
+
+/**
+ * @brief Open nested object, closed with esp_httpd_json_close()
+ *
+ * @jw Writer
+ * @key Member name, NULL inside array
+ */
+void esp_httpd_json_object(esp_httpd_json_t *jw, const char *key);
+
+/**
+ * @brief Open nested array, closed with esp_httpd_json_close()
+ *
+ * @jw Writer
+ * @key Member name, NULL inside array
+ */
+void esp_httpd_json_array(esp_httpd_json_t *jw, const char *key);
+
+/**
+ * @brief Close innermost open object or array
+ *
+ * @jw Writer
+ */
+void esp_httpd_json_close(esp_httpd_json_t *jw);
+
+/**
+ * @brief Write string member, value is escaped
+ *
+ * @jw Writer
+ * @key Member name, NULL inside array
+ * @value Zero terminated string
+ */
+void esp_httpd_json_string(esp_httpd_json_t *jw, const char *key, const char *value);
+
+/**
+ * @brief Write integer number member
+ *
+ * @jw Writer
+ * @key Member name, NULL inside array
+ * @value Number
+ */
+void esp_httpd_json_int(esp_httpd_json_t *jw, const char *key, long value);
+
+/**
+ * @brief Write true or false member
+ *
+ * @jw Writer
+ * @key Member name, NULL inside array
+ * @value Boolean
+ */
+void esp_httpd_json_bool(esp_httpd_json_t *jw, const char *key, bool value);
+
+#define HTTPD_ETAG_LEN 80       //quoted sha256 hex with encoding suffix
+#define HTTPD_ETAG_BODY_LEN 512 //largest document tagged by esp_httpd_resp_json_etag()
+
+/**
+ * @brief Answer conditional GET
+ *
+ * Sets ETag made of tag and response encoding and Cache-Control: no-cache,
+ * so browsers revalidate every time. When If-None-Match lists the ETag,
+ * bodyless 304 Not Modified is sent.
+ *
+ * @req The request being responded to
+ * @etag Buffer for header value, must stay valid until response is sent
+ * @tag Version or content hash of the document
+ *
+ * @return true when 304 was sent and handler is done
+ */
+bool esp_httpd_resp_not_modified(httpd_req_t *req, char etag[HTTPD_ETAG_LEN], const char *tag);
+
+typedef void (*esp_httpd_json_render_t)(esp_httpd_json_t *jw, void *arg);
+
+/**
+ * @brief Send document tagged by hash of its content
+ *
+ * Document is rendered into a HTTPD_ETAG_BODY_LEN stack buffer, hashed and
+ * either sent or answered with 304 Not Modified. Larger document is
+ * streamed without ETag. Render writes members of root object.
+ *
+ * @req The request being responded to
+ * @render Writes the document
+ * @arg Argument of render
+ *
+ * @return ESP_OK or error of httpd_resp_send
+ */
+esp_err_t esp_httpd_resp_json_etag(httpd_req_t *req, esp_httpd_json_render_t render, void *arg);
+
+/**
+ * @brief Selection of fields in esp_httpd_batch_handler() section
+ */
+typedef struct {
+    const char *include; //comma separated "section" or "section.field" list, NULL for all
+    const char *name;    //section being rendered
+} esp_httpd_batch_t;
+
+/**
+ * @brief Section of esp_httpd_batch_handler() response
+ *
+ * Render writes members of the section object, fields are tested with
+ * esp_httpd_batch_field().
+ */
+typedef struct {
+    const char *name;
+    void (*render)(esp_httpd_json_t *jw, const esp_httpd_batch_t *sel, void *arg);
+    void *arg;
+} esp_httpd_batch_section_t;
+
+#define HTTPD_BATCH_INCLUDE_LEN 128
+
+/**
+ * @brief Check whether section field was asked for
+ *
+ * Field is included when listed as "section.field", or when by_default is
+ * set and section is listed by bare name or include list is missing.
+ *
+ * @sel Selection passed to section render
+ * @field Field name
+ * @by_default Field is part of section asked by bare name
+ *
+ * @return true when field should be written
+ */
+bool esp_httpd_batch_field(const esp_httpd_batch_t *sel, const char *field, bool by_default);
+
+/**
+ * @brief Serve several documents in one response
+ *
+ * user_ctx is an array of sections terminated by entry with NULL name.
+ * Response has an object per section listed in include query, e.g.
+ * "/batch?include=wifi.sta,app,spiffs.files", or all sections with their
+ * default fields without include.
+
+	static const esp_httpd_batch_section_t batch_sections[] = {
+		{ "wifi", esp_httpd_wifi_info_section },
+		{ "app", esp_httpd_app_info_section },
+		{ "spiffs", esp_httpd_spiffs_info_section, &spiffs_conf },
+		{ NULL }
+	};
+	httpd_uri_t batch_handler = {
+		.uri       = "/batch",
+		.method    = HTTP_GET,
+		.handler   = esp_httpd_batch_handler,
+		.user_ctx  = (void *)batch_sections
+	}
+ */
+esp_err_t esp_httpd_batch_handler(httpd_req_t *req);
+
+/**
+ * @brief Continue request in async worker task
+ *
+ * HTTPD task is released to serve other requests while one of
+ * CONFIG_HTTPD_ASYNC_WORKERS tasks calls handler again with a copy of the
+ * request. Long running handler starts with:
+
+	if (esp_httpd_async_detach(req, my_handler) == ESP_OK)
+		return ESP_OK;
+
+ * Handler result other than ESP_OK closes the connection, as it does in
+ * HTTPD task.
+ *
+ * @req The request being responded to
+ * @handler Handler to call from worker
+ *
+ * @return
+ *  - ESP_OK : Request is handled by worker
+ *  - ESP_ERR_NOT_SUPPORTED : CONFIG_HTTPD_ASYNC_HANDLERS disabled or ESP-IDF older than 5.1
+ *  - ESP_ERR_INVALID_STATE : Called from worker, handle request in place
+ *  - ESP_ERR_NO_MEM : All workers busy, handle request in place
+ */
+esp_err_t esp_httpd_async_detach(httpd_req_t *req, esp_err_t (*handler)(httpd_req_t *req));
+
 #ifdef __cplusplus
 }
 #endif
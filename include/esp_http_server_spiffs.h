@@ -10,6 +10,7 @@
 #include <stdbool.h>
 #include <esp_err.h>
 #include <esp_http_server.h>
+#include "esp_http_server_misc.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,6 +31,12 @@ extern "C" {
  */
 esp_err_t esp_httpd_spiffs_info_handler(httpd_req_t *req);
 
+/**
+ * @brief esp_httpd_batch_handler() section with SPIFFS usage, file list is
+ * included only when asked as "spiffs.files". arg is esp_vfs_spiffs_conf_t.
+ */
+void esp_httpd_spiffs_info_section(esp_httpd_json_t *jw, const esp_httpd_batch_t *sel, void *arg);
+
 /**
  * @brief SPIFFS file upload handler, should be configured like:
  	httpd_uri_t upload_handler = {
@@ -38,6 +45,11 @@ esp_err_t esp_httpd_spiffs_info_handler(httpd_req_t *req);
 		.handler   = esp_httpd_spiffs_file_upload_handler,
 		.user_ctx  = "/spiffs/upload"  //SPIFFS path for uploaded file
 	}
+
+	With path ending in '/' (e.g. "/spiffs/") every file part of the
+	request is stored as path + part filename. Filenames with "." or ".."
+	components are refused. Response lists result and size of each file,
+	total bytes, time_ms and bytes_per_sec.
  *
  * @req The request being responded to
  *
@@ -61,6 +73,9 @@ esp_err_t esp_httpd_spiffs_file_upload_handler(httpd_req_t *req);
 		.handler   = esp_httpd_spiffs_image_upload_handler,
 		.user_ctx  = spiffs_conf
 	}
+
+	Request with If-None-Match header naming SHA-256 of whole partition is
+	answered with 304 Not Modified without receiving the body.
  *
  * @req The request being responded to
  *
@@ -8,6 +8,7 @@
 #define _ESP_HTTP_SERVER_WIFI_H_
 
 #include <esp_http_server.h>
+#include "esp_http_server_misc.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +16,41 @@ extern "C" {
 
 esp_err_t esp_httpd_wifi_handler(httpd_req_t *req);
 
+/**
+ * @brief Wi-Fi state event stream (Server-Sent Events)
+ *
+	httpd_uri_t wifi_events_handler = {
+		.uri       = "/wifi/events",
+		.method    = HTTP_GET,
+		.handler   = esp_httpd_wifi_events_handler,
+	}
+
+	Response stays open. First "wifi" event carries "ap" and "sta" state as
+	data of esp_httpd_wifi_handler response, following events carry only
+	interfaces whose state changed. State is read on WIFI_EVENT and IP_EVENT
+	and every CONFIG_HTTPD_WIFI_EVENTS_RSSI_INTERVAL seconds, once for all
+	subscribers. Each of CONFIG_HTTPD_WIFI_EVENTS_MAX_CLIENTS subscribers
+	keeps one HTTPD socket, further clients get 503.
+ *
+ * @req The request being responded to
+ *
+ * @return
+ *  - ESP_OK : On success, error number otherwise
+ */
+esp_err_t esp_httpd_wifi_events_handler(httpd_req_t *req);
+
+/**
+ * @brief esp_httpd_batch_handler() section with "ap" and "sta" interface
+ * state, as data of esp_httpd_wifi_handler response
+ */
+void esp_httpd_wifi_info_section(esp_httpd_json_t *jw, const esp_httpd_batch_t *sel, void *arg);
+
+/**
+ * @brief esp_httpd_batch_handler() section with "ap" and "sta" SSIDs, as
+ * data of esp_httpd_wifi_handler get_config response
+ */
+void esp_httpd_wifi_config_section(esp_httpd_json_t *jw, const esp_httpd_batch_t *sel, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
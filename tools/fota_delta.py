@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 <qb4.dev@gmail.com>
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+# Create patch for esp_httpd_fota_delta_handler from running and new
+# firmware images. Requires bsdiff4 package (pip install bsdiff4).
+#
+# usage: fota_delta.py old.bin new.bin patch.bin [--gzip]
+
+import argparse
+import gzip
+import hashlib
+import struct
+import sys
+
+import bsdiff4.core
+
+PATCH_MAGIC = b'ESPDELTA'
+ESP_IMAGE_MAGIC = 0xE9
+HASH_APPENDED_OFFSET = 23  # esp_image_header_t.hash_appended
+SHA256_LEN = 32
+
+
+def image_sha256(image):
+    """Image digest as reported by esp_partition_get_sha256()"""
+    if len(image) > HASH_APPENDED_OFFSET and image[0] == ESP_IMAGE_MAGIC and image[HASH_APPENDED_OFFSET] == 1:
+        return image[-SHA256_LEN:]
+    return hashlib.sha256(image).digest()
+
+
+def offtout(x):
+    """bsdiff sign and magnitude 64 bit integer"""
+    return struct.pack('<Q', -x | 1 << 63 if x < 0 else x)
+
+
+def make_patch(old, new):
+    control, diff, extra = bsdiff4.core.diff(old, new)
+    out = [PATCH_MAGIC, image_sha256(old), struct.pack('<II', len(new), 0)]
+    d = e = 0
+    for x, y, z in control:
+        out += [offtout(x), offtout(y), offtout(z), diff[d:d + x], extra[e:e + y]]
+        d += x
+        e += y
+    return b''.join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Create delta FOTA patch')
+    parser.add_argument('old', help='running firmware image')
+    parser.add_argument('new', help='new firmware image')
+    parser.add_argument('patch', help='output patch file')
+    parser.add_argument('--gzip', action='store_true', help='compress patch, needs CONFIG_HTTPD_FOTA_DECOMPRESS')
+    args = parser.parse_args()
+
+    with open(args.old, 'rb') as f:
+        old = f.read()
+    with open(args.new, 'rb') as f:
+        new = f.read()
+
+    patch = make_patch(old, new)
+    if args.gzip:
+        patch = gzip.compress(patch, mtime=0)
+
+    with open(args.patch, 'wb') as f:
+        f.write(patch)
+    print('%s: %d bytes, new image %d bytes (%.1f%%)' % (args.patch, len(patch), len(new),
+                                                        100.0 * len(patch) / len(new)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 <qb4.dev@gmail.com>
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+# Upload firmware to esp_httpd_fota_ranged_handler over several connections.
+#
+# usage: fota_ranged.py [-c CONNECTIONS] [-r RANGE_SIZE] URL firmware.bin
+
+import argparse
+import concurrent.futures
+import hashlib
+import http.client
+import json
+import sys
+import urllib.parse
+import uuid
+
+
+def post_range(url, image, first, last, image_hash, retries):
+    boundary = uuid.uuid4().hex
+    body = b''.join([
+        b'--' + boundary.encode() + b'\r\n',
+        b'Content-Disposition: form-data; name="file"; filename="firmware.bin"\r\n',
+        b'Content-Type: application/octet-stream\r\n\r\n',
+        image[first:last + 1],
+        b'\r\n--' + boundary.encode() + b'--\r\n',
+    ])
+    headers = {
+        'Content-Type': 'multipart/form-data; boundary=' + boundary,
+        'Content-Range': 'bytes %d-%d/%d' % (first, last, len(image)),
+        'X-Image-Hash': image_hash,
+    }
+    for attempt in range(retries + 1):
+        conn = http.client.HTTPConnection(url.netloc, timeout=60)
+        try:
+            conn.request('POST', url.path, body, headers)
+            resp = conn.getresponse()
+            result = json.loads(resp.read() or b'{}')
+            if resp.status == 200 and result.get('result') == 'ESP_OK':
+                return result
+            print('range %d-%d: %d %s' % (first, last, resp.status, result.get('result')), file=sys.stderr)
+        except (OSError, http.client.HTTPException, ValueError) as e:
+            # device reboots right after last range response
+            print('range %d-%d: %s' % (first, last, e), file=sys.stderr)
+        finally:
+            conn.close()
+    raise RuntimeError('range %d-%d failed' % (first, last))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Ranged parallel FOTA upload')
+    parser.add_argument('-c', '--connections', type=int, default=3, help='concurrent connections')
+    parser.add_argument('-r', '--range-size', type=int, default=65536, help='CONFIG_HTTPD_FOTA_RANGE_SIZE')
+    parser.add_argument('--retries', type=int, default=2)
+    parser.add_argument('url', help='e.g. http://192.168.4.1/update/range')
+    parser.add_argument('firmware')
+    args = parser.parse_args()
+
+    with open(args.firmware, 'rb') as f:
+        image = f.read()
+    url = urllib.parse.urlparse(args.url)
+    image_hash = hashlib.sha256(image).hexdigest()
+    ranges = [(first, min(first + args.range_size, len(image)) - 1) for first in range(0, len(image), args.range_size)]
+
+    # first range carries image headers checked by device, send it alone
+    post_range(url, image, *ranges[0], image_hash, args.retries)
+    last_range = ranges.pop()
+    with concurrent.futures.ThreadPoolExecutor(args.connections) as pool:
+        jobs = [pool.submit(post_range, url, image, first, last, image_hash, args.retries) for first, last in ranges[1:]]
+        for job in concurrent.futures.as_completed(jobs):
+            result = job.result()
+            print('%d/%d ranges' % (result['ranges_done'], result['ranges']))
+    if ranges:
+        # remaining range completes the update
+        post_range(url, image, *last_range, image_hash, args.retries)
+    print('upload complete')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024 <qb4.dev@gmail.com>
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+# Convert raw SPIFFS partition image into sparse image accepted by
+# esp_httpd_spiffs_image_upload_handler. Erased (0xFF) and other uniform
+# blocks are sent as FILL chunks, the rest as RAW chunks.
+#
+# usage: spiffs_sparse.py [-b BLOCK_SIZE] spiffs.bin spiffs.simg
+
+import argparse
+import struct
+import sys
+
+SPARSE_HEADER_MAGIC = 0xED26FF3A
+SPARSE_FILE_HDR_SZ = 28
+SPARSE_CHUNK_HDR_SZ = 12
+CHUNK_RAW = 0xCAC1
+CHUNK_FILL = 0xCAC2
+FLASH_SECTOR_SIZE = 4096
+
+
+def block_fill(block):
+    """32 bit fill value when block repeats it, None otherwise"""
+    value = block[:4]
+    return struct.unpack('<I', value)[0] if block == value * (len(block) // 4) else None
+
+
+def make_sparse(image, blk_sz):
+    chunks = []  # [fill value or None, blocks, data]
+    for offset in range(0, len(image), blk_sz):
+        block = image[offset:offset + blk_sz]
+        fill = block_fill(block)
+        last = chunks[-1] if chunks else None
+        if last and last[0] == fill:
+            last[1] += 1
+            if fill is None:
+                last[2].append(block)
+        else:
+            chunks.append([fill, 1, [block] if fill is None else None])
+
+    out = [struct.pack('<IHHHHIIII', SPARSE_HEADER_MAGIC, 1, 0, SPARSE_FILE_HDR_SZ, SPARSE_CHUNK_HDR_SZ, blk_sz,
+                       len(image) // blk_sz, len(chunks), 0)]
+    for fill, blocks, data in chunks:
+        if fill is None:
+            data = b''.join(data)
+            out += [struct.pack('<HHII', CHUNK_RAW, 0, blocks, SPARSE_CHUNK_HDR_SZ + len(data)), data]
+        else:
+            out.append(struct.pack('<HHIII', CHUNK_FILL, 0, blocks, SPARSE_CHUNK_HDR_SZ + 4, fill))
+    return b''.join(out), len(chunks)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Create sparse SPIFFS image')
+    parser.add_argument('-b', '--block-size', type=int, default=FLASH_SECTOR_SIZE,
+                        help='sparse block size, multiple of 4096 bytes flash sector')
+    parser.add_argument('image', help='raw SPIFFS partition image')
+    parser.add_argument('sparse', help='output sparse image')
+    args = parser.parse_args()
+
+    if args.block_size <= 0 or args.block_size % FLASH_SECTOR_SIZE:
+        parser.error('block size must be a multiple of %d' % FLASH_SECTOR_SIZE)
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    # partition images are sector aligned, pad other images as erased flash
+    image += b'\xff' * (-len(image) % args.block_size)
+
+    sparse, chunks = make_sparse(image, args.block_size)
+    with open(args.sparse, 'wb') as f:
+        f.write(sparse)
+    print('%d bytes in %d chunks, %d bytes sparse image' % (len(image), chunks, len(sparse)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())